@@ -1,4 +1,6 @@
-﻿#include <sys/stat.h>
+﻿#define _XOPEN_SOURCE 600 // pwrite, fileno
+
+#include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -9,7 +11,6 @@
 #include <assert.h>
 #include <math.h>
 #include <sys/types.h>
-#include <utime.h>
 
 #ifdef _WIN32
 #ifndef WIN32_LEAN_AND_MEAN
@@ -22,6 +23,14 @@
 #include <unistd.h> // for usleep
 #endif
 
+#ifdef _WIN32
+#include <io.h>     // for _get_osfhandle
+#else
+#include <unistd.h> // for pwrite
+#include <sys/mman.h>
+#include <time.h>   // for clock_gettime
+#endif
+
 #include "zopfli/zopfli.h"
 #include "miniz.h"
 #include "Adpcm/adpcm.h"
@@ -34,6 +43,8 @@
 #include "queue.h"
 #include "listfile.h"
 #include "lonesha256.h"
+#include "memcache.h"
+#include "diskcache.h"
 
 #if defined(_WIN32)
 #include <direct.h>
@@ -46,6 +57,9 @@
 #define FLAG_FILE_COMPRESSED    (0x00000200)
 #define FLAG_FILE_EXISTS        (0x80000000)
 
+// part of every cache key, bumped when the cached data changes
+#define CACHE_VERSION 1
+
 struct header {
     char magic[4];
     uint32_t headerSize;
@@ -60,19 +74,165 @@ struct header {
 
 typedef struct header header_t;
 
+// a file inside the input mpq, ready to be decoded sector by sector
+struct mpqfile {
+    char *path;
+    btentry_t *bte;
+    char *fileInMpq;
+    uint32_t baseKey;
+    int encrypted;
+    uint32_t sectorSize;
+    size_t numSectors;
+    uint32_t *sectorOffsetTable; // decrypted copy, NULL if there is none
+};
+
+typedef struct mpqfile mpqfile_t;
+
+// a file which gets packed sector by sector. the sectors are handed out
+// individually to the threads and whoever finishes the last one assembles
+// the sector offset table and writes the file.
+struct packjob {
+    char *path;
+    sys_lock_t lock;
+    int extracted;
+
+    // either the whole content or, if the file is streamed, the input
+    // file every sector job decodes its own part from
+    int streamed;
+    char *content;
+    int borrowed;
+    mpqfile_t in;
+    size_t insize;
+
+    size_t numSectors;
+    size_t pending;
+    double cost;
+    // when the first sector was started, see --file-time
+    double startTime;
+    unsigned char **sectors;
+    size_t *sectorSizes;
+
+    size_t outsize;
+    uint32_t flags;
+    btentry_t bte;
+
+    // set if the content is the same as that of another file. only the
+    // original is packed and both block table entries point to it.
+    struct packjob *original;
+
+    // the memory the sectors hold until WriteJob, see EstimateMemory
+    uint64_t held;
+};
+
+typedef struct packjob packjob_t;
+
+struct sectorjob {
+    packjob_t *file;
+    size_t sector;
+    // estimated peak memory of packing the sector, see --memory-limit. held
+    // is the part which stays in use until the file is written.
+    uint64_t memory;
+    uint64_t held;
+};
+
+typedef struct sectorjob sectorjob_t;
+
+// the context of OutOfTime while a sector is packed. stopped tells whether the
+// iterations were cut short, such a result isn't kept in the disk cache.
+struct stopcontext {
+    packjob_t *job;
+    volatile int stopped;
+};
+
+typedef struct stopcontext stopcontext_t;
+
+// independent zopfli tasks of one sector, idle threads help with them
+struct taskbatch {
+    ZopfliTask *task;
+    void *context;
+    volatile size_t done;
+};
+
+typedef struct taskbatch taskbatch_t;
+
+// one task of a batch. RunParallel pushes them to the deque of its thread in
+// the task queue, idle threads steal them from there.
+struct task {
+    taskbatch_t *batch;
+    size_t index;
+};
+
+typedef struct task task_t;
+
+// the amount of tasks every thread can have queued, the ones which don't fit
+// are run right away
+#define TASK_CAPACITY 1024
+
+// how hard the sectors are compressed, see --level
+enum Level {
+    LevelFast,
+    LevelMax,
+    LevelZopfli
+};
+
 struct {
     FILE *mpq_file;
-    sys_lock_t lock;
     table_t mpq_table;
     queue_t work_queue;
+    packjob_t *files;
+    size_t numFiles;
     size_t bytesWritten;
     size_t totalInSize;
     size_t totalOutSize;
     size_t filesProceeded;
+
+    // sector jobs which aren't finished yet
+    size_t sectorsPending;
+    int numThreads;
+
+    // the files which have the same size as another one and are hashed by
+    // all threads before packing starts, see HashFiles
+    packjob_t **hashed;
+    unsigned char (*hashes)[32];
+    size_t numHashed;
+    volatile size_t nextHash;
+    volatile size_t threadsHashed;
+    volatile size_t jobsQueued;
+    // zopfli scratch memory of each thread by Sys_ThreadIndex
+    ZopfliScratch **scratches;
+    queue_t task_queue;
+    // idle threads and threads waiting for their tasks sleep on workCond
+    // until workEpoch changes, see NotifyWork
+    sys_lock_t workLock;
+    sys_cond_t workCond;
+    volatile size_t workEpoch;
+
+    // memory admission of the sector jobs, see Admit. jobs which didn't fit
+    // wait in deferred until enough memory is free. memoryUsed is that of
+    // the sectors being packed, memoryHeld that of their files which are not
+    // written yet.
+    uint64_t memoryLimit;
+    volatile uint64_t memoryUsed;
+    volatile uint64_t memoryHeld;
+    sys_lock_t deferLock;
+    sectorjob_t **deferred;
+    size_t numDeferred;
+
+    // time limits in seconds, 0 if there is none. see OutOfTime
+    double startTime;
+    double timeBudget;
+    double fileTime;
     
     size_t mpqShift;
     size_t blockSize;
     int useCache;
+    // the persistent cache, see --cache-dir and --cache-size
+    diskcache_t diskCache;
+    char *cacheDir;
+    uint64_t cacheSize;
+    // packed sectors of this run, see --memory-cache
+    memcache_t memCache;
+    enum Level level;
     ZopfliOptions zopfli_options;
     
     struct {
@@ -87,9 +247,6 @@ struct {
     listfile_t listfile;
 } globals;
 
-static const char Base64URLTable[] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
-
 void sleep_ms(int milliseconds){ // cross-platform sleep function
 #ifdef WIN32
     Sleep(milliseconds);
@@ -105,6 +262,16 @@ void sleep_ms(int milliseconds){ // cross-platform sleep function
 #endif
 }
 
+double Seconds(void){ // monotonic clock in seconds
+#ifdef WIN32
+    return GetTickCount() / 1000.0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
 int IsDelim(char c, char *delim){
     for(; *delim; delim++){
         if(c == *delim)
@@ -173,6 +340,10 @@ btentry_t* FindBTE(table_t *tbl, const char *path){
     return NULL;
 }
 
+static uint32_t ReadInt(const unsigned char *in, size_t off){
+    return in[off] | (in[off+1] << 8) | (in[off+2] << 16) | ((uint32_t)in[off+3] << 24);
+}
+
 static void WriteInt(unsigned char *out, size_t off, uint32_t n){
     out[off++] = n & 0xFF;
     out[off++] = (n >> 8) & 0xFF;
@@ -252,86 +423,187 @@ int decompress(void *outBuf, size_t *outLen, void *inBuf, size_t inSize){
 }
 //int DecompressHuffman(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer);
 
-char* ExtractFile(char *mpq, header_t *hd, table_t *tbl, char *path, size_t *out){
+int OpenMpqFile(char *mpq, header_t *hd, table_t *tbl, char *path, mpqfile_t *f){
     btentry_t *bte = FindBTE(tbl, path);
     if(!bte){
-        return NULL;
+        return 0;
     }
-    uint32_t baseKey = hash(GetFileName(path), TableKey);
-    int encrypted = bte->flags & FLAG_FILE_ENCRYPTED;
+    f->path = path;
+    f->bte = bte;
+    f->baseKey = hash(GetFileName(path), TableKey);
+    f->encrypted = bte->flags & FLAG_FILE_ENCRYPTED;
     if(bte->flags & FLAG_FILE_KEY_ADJUSTED)
-        baseKey = (baseKey + bte->filePos) ^ bte->normalSize;
-    
-    char *file = malloc(bte->normalSize);
-    char *fileInMpq = mpq+bte->filePos;
+        f->baseKey = (f->baseKey + bte->filePos) ^ bte->normalSize;
+    f->fileInMpq = mpq+bte->filePos;
+    f->sectorSize = 512 * (1 << hd->shift);
+    f->numSectors = (bte->normalSize + f->sectorSize - 1) / f->sectorSize;
+    f->sectorOffsetTable = NULL;
+
+    if(!(bte->flags & FLAG_FILE_SINGLE_UNIT) && bte->flags & FLAG_FILE_COMPRESSED){
+        // the input is mapped read-only so the table is decrypted in a copy
+        size_t sotSize = (f->numSectors+1)*sizeof(uint32_t);
+        f->sectorOffsetTable = malloc(sotSize);
+        memcpy(f->sectorOffsetTable, f->fileInMpq, sotSize);
+        if(f->encrypted)
+            DecryptBlock(f->sectorOffsetTable, sotSize, f->baseKey-1);
+    }
+    return 1;
+}
+
+void CloseMpqFile(mpqfile_t *f){
+    free(f->sectorOffsetTable);
+    f->sectorOffsetTable = NULL;
+}
+
+// Returns a pointer into the mpq if the sectors [first, last) are stored
+// unencrypted and uncompressed, NULL if they have to be decoded.
+static char* SectorView(mpqfile_t *f, size_t first, size_t last){
+    size_t start = first * f->sectorSize;
+    size_t end = last * f->sectorSize;
+    if(end > f->bte->normalSize)
+        end = f->bte->normalSize;
+
+    if(f->encrypted)
+        return NULL;
+    if(!(f->bte->flags & FLAG_FILE_COMPRESSED))
+        return f->fileInMpq + start;
+    // if every sector was stored uncompressed they follow each other
+    // without gaps
+    if(f->sectorOffsetTable
+    && f->sectorOffsetTable[last] - f->sectorOffsetTable[first] == end - start)
+        return f->fileInMpq + f->sectorOffsetTable[first];
+    return NULL;
+}
+
+// Decodes the sectors [first, last) of a file which isn't stored as a
+// single unit to out.
+int ReadSectors(mpqfile_t *f, size_t first, size_t last, char *out){
+    uint32_t *sectorOffsetTable = f->sectorOffsetTable;
+    char *sector = NULL;
+    int err = Ok;
+
+    // the input is mapped read-only so everything that needs decrypting
+    // is copied first
+    if(f->encrypted)
+        sector = malloc(f->sectorSize);
+
+    for(size_t idx = first; idx != last && err == Ok; idx++){
+        uint32_t thisSectorSize = f->sectorSize;
+        uint32_t size;
+        char *sectorInMpq;
+
+        // last sector so the size can be less than sectorSize
+        if(idx == f->numSectors-1 && f->bte->normalSize % f->sectorSize)
+            thisSectorSize = f->bte->normalSize % f->sectorSize;
+
+        if(sectorOffsetTable){
+            size = sectorOffsetTable[idx+1] - sectorOffsetTable[idx];
+            sectorInMpq = f->fileInMpq + sectorOffsetTable[idx];
+        }else{
+            size = thisSectorSize;
+            sectorInMpq = f->fileInMpq + idx*f->sectorSize;
+        }
+
+        if(f->encrypted && size <= f->sectorSize){
+            memcpy(sector, sectorInMpq, size);
+            DecryptBlock(sector, size, f->baseKey+idx);
+            sectorInMpq = sector;
+        }
+
+        if(size == thisSectorSize){
+            // this sector is not compressed
+            memcpy(out, sectorInMpq, size);
+        }else{
+            size_t destLen = thisSectorSize;
+            err = decompress(out, &destLen, sectorInMpq, size);
+            if(Ok != err){
+                fprintf(stderr, "Error while decompressing '%s' (%d, %d)\n", f->path, *sectorInMpq, err);
+            }
+        }
+        out += thisSectorSize;
+    }
+
+    free(sector);
+    return err;
+}
+
+// Decodes the bytes [start, start+len) of a file which isn't stored as a
+// single unit, touching only the sectors covering that range. buffer must
+// hold len plus one sector. Returns a pointer to the first byte, which is
+// either a view into the mpq or points into buffer.
+char* ReadRange(mpqfile_t *f, size_t start, size_t len, char *buffer){
+    size_t first = start / f->sectorSize;
+    size_t last = (start + len + f->sectorSize - 1) / f->sectorSize;
+    char *view = SectorView(f, first, last);
+    if(view)
+        return view + (start - first*f->sectorSize);
+    if(Ok != ReadSectors(f, first, last, buffer))
+        return NULL;
+    return buffer + (start - first*f->sectorSize);
+}
+
+// Returns the content of the file. If the file is stored unencrypted and
+// uncompressed the returned pointer points directly into the mpq and
+// *borrowed is set, otherwise it's a malloc'd buffer the caller has to free.
+char* ExtractFileView(char *mpq, header_t *hd, table_t *tbl, char *path, size_t *out, int *borrowed){
+    mpqfile_t f;
+    if(!OpenMpqFile(mpq, hd, tbl, path, &f)){
+        return NULL;
+    }
+    btentry_t *bte = f.bte;
     if(out)
         *out = bte->normalSize;
-    size_t destLen;
+
+    char *file = SectorView(&f, 0, f.numSectors);
+    *borrowed = file != NULL;
+    if(file){
+        CloseMpqFile(&f);
+        return file;
+    }
+
+    file = malloc(bte->normalSize);
 
     if(bte->flags & FLAG_FILE_SINGLE_UNIT && !(bte->flags & FLAG_FILE_COMPRESSED)){
-        memcpy(file, fileInMpq, bte->normalSize);
-        if(encrypted)
-            DecryptBlock(file, bte->normalSize, baseKey);
-    }else if(!(bte->flags & FLAG_FILE_COMPRESSED) && !(bte->flags & FLAG_FILE_SINGLE_UNIT)){
-        uint32_t sectorSize = 512 * (1 << hd->shift);
-        size_t numSectors = (size_t)ceil((float)bte->normalSize / sectorSize);
-        for(size_t i = 0, offset = 0; i != numSectors; i++, offset += sectorSize){
-            uint32_t thisSize = sectorSize;
-            if(i == numSectors-1)
-                thisSize = bte->normalSize % sectorSize;
-            memcpy(file+offset, fileInMpq+offset, thisSize);
-            DecryptBlock(file+offset, thisSize, baseKey+i);
+        memcpy(file, f.fileInMpq, bte->normalSize);
+        DecryptBlock(file, bte->normalSize, f.baseKey);
+    }else if(bte->flags & FLAG_FILE_SINGLE_UNIT){
+        // the input is mapped read-only so decrypt a private copy
+        char *compressed = f.fileInMpq;
+        if(f.encrypted){
+            compressed = malloc(bte->compressedSize);
+            memcpy(compressed, f.fileInMpq, bte->compressedSize);
+            DecryptBlock(compressed, bte->compressedSize, f.baseKey);
         }
-    }else if(bte->flags & FLAG_FILE_SINGLE_UNIT && bte->flags & FLAG_FILE_COMPRESSED){
-        if(encrypted)
-            DecryptBlock(file, bte->compressedSize, baseKey);
 
-        int err = decompress(file, &destLen, fileInMpq, bte->compressedSize-1);
+        size_t destLen = bte->normalSize;
+        int err = decompress(file, &destLen, compressed, bte->compressedSize-1);
+        if(f.encrypted)
+            free(compressed);
         if(Ok != err){
-            fprintf(stderr, "Error while decompressing '%s' (%d, %d)\n", path, *fileInMpq, err);
+            fprintf(stderr, "Error while decompressing '%s' (%d, %d)\n", path, *f.fileInMpq, err);
             free(file);
-            return NULL;
-        }
-        
-    }else{
-        // we've got a sector offset table
-        uint32_t sectorSize = 512 * (1 << hd->shift);
-        size_t numSectors = (size_t)(1+ceil((float)(bte->normalSize) / sectorSize));
-        uint32_t *sectorOffsetTable = (uint32_t*)fileInMpq;
-        size_t offset = 0;
-
-        if(encrypted)
-            DecryptBlock(sectorOffsetTable, numSectors*sizeof(uint32_t), baseKey-1);
-        
-        for(size_t idx = 0; idx != numSectors-1; idx++){
-            uint32_t size = sectorOffsetTable[idx+1] - sectorOffsetTable[idx];
-            uint32_t thisSectorSize = sectorSize;
-            
-            // in case of strange errors: check this
-            if(idx == numSectors -2) // last sector so the size can be less than sectorSize
-                thisSectorSize = bte->normalSize % sectorSize;
-            if(thisSectorSize == 0)
-                thisSectorSize = sectorSize;
-            destLen = thisSectorSize;
-            
-            if(encrypted)
-                DecryptBlock(fileInMpq+sectorOffsetTable[idx], size, baseKey+idx);
-            
-            if(size == thisSectorSize){
-                // this sector is not compressed
-                memcpy(file+offset, fileInMpq+sectorOffsetTable[idx], size);
-            }else{
-                int err = decompress(file+offset, &destLen, fileInMpq+sectorOffsetTable[idx], size);
-                if(Ok != err){
-                    fprintf(stderr, "Error while decompressing '%s' (%d, %d)\n", path, *(fileInMpq+sectorOffsetTable[idx]), err);
-                    free(file);
-                    return NULL;
-                }
-            }
-            offset += sectorSize;
+            file = NULL;
         }
+    }else if(Ok != ReadSectors(&f, 0, f.numSectors, file)){
+        free(file);
+        file = NULL;
     }
-    
+
+    CloseMpqFile(&f);
+    return file;
+}
+
+char* ExtractFile(char *mpq, header_t *hd, table_t *tbl, char *path, size_t *out){
+    size_t size = 0;
+    int borrowed = 0;
+    char *file = ExtractFileView(mpq, hd, tbl, path, &size, &borrowed);
+    if(file && borrowed){
+        char *copy = malloc(size);
+        memcpy(copy, file, size);
+        file = copy;
+    }
+    if(out)
+        *out = size;
     return file;
 }
 
@@ -352,6 +624,44 @@ static char* Sys_ReadFile(const char *path, size_t *insize){
     return buffer;
 }
 
+// maps the file read-only so only the pages that are actually used get read
+static char* Sys_MapFile(const char *path, size_t *insize){
+#ifdef _WIN32
+    HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE){
+        fprintf(stderr, "Couldn't open file '%s'\n", path);
+        exit(1);
+    }
+    LARGE_INTEGER s;
+    GetFileSizeEx(hFile, &s);
+    HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    char *buffer = hMap ? MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if(hMap)
+        CloseHandle(hMap);
+    CloseHandle(hFile);
+    *insize = (size_t)s.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd == -1){
+        fprintf(stderr, "Couldn't open file '%s'\n", path);
+        exit(1);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    char *buffer = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if(buffer == MAP_FAILED)
+        buffer = NULL;
+    close(fd);
+    *insize = st.st_size;
+#endif
+    if(!buffer){
+        fprintf(stderr, "Couldn't map file '%s'\n", path);
+        exit(1);
+    }
+    return buffer;
+}
+
 void WriteHT(){
     if(globals.mpq_table.htSize == 0)
         return;
@@ -451,342 +761,737 @@ int ListfileSufficient(table_t *tbl, listfile_t *listfile){
 }
 
 
-void PackFile(unsigned char *content, size_t contentSize, size_t bufferSize, unsigned char *out, size_t *outsize, uint32_t *flags){
-    unsigned char *zopfli_out;
-    size_t zopfli_outsize;
-    ZopfliFormat format = ZOPFLI_FORMAT_ZLIB;
-
-    size_t written = 0;
-    size_t offsetTableSize = 4*(1+ ceil( ((float)contentSize)/globals.blockSize ));
-    uint32_t *sectorOffsetTable = malloc(offsetTableSize);
-    size_t tableIdx = 1;
-    size_t outpos = 0;
-
-    for(size_t start = 0, end = contentSize; start < end; start += globals.blockSize){
-        size_t len = end-start > globals.blockSize ? globals.blockSize : end-start;
-        zopfli_outsize = 0;
-        ZopfliCompress(&globals.zopfli_options, format, content+start, len, &zopfli_out, &zopfli_outsize);
-        if(zopfli_outsize < len && zopfli_outsize <= globals.blockSize -2){
-            written += 1+zopfli_outsize;
-            assert(written < bufferSize);
-            out[outpos] = 2;
-            memcpy(out+outpos+1, zopfli_out, zopfli_outsize);
-            sectorOffsetTable[tableIdx++] = 1+zopfli_outsize;
-            outpos += 1+zopfli_outsize;
-        }else{
-            written += len;
-            assert(written < bufferSize);
-            memcpy(out+outpos, content+start, len);
-            sectorOffsetTable[tableIdx++] = len;
-            outpos += len;
+// Deflates a sector into a raw deflate stream, NULL if that fails.
+static unsigned char* DeflateSector(const ZopfliOptions *options, const unsigned char *content, size_t len, size_t *outsize){
+    unsigned char *out = NULL;
+
+    if(globals.level == LevelZopfli){
+        *outsize = 0;
+        ZopfliCompress(options, ZOPFLI_FORMAT_DEFLATE, content, len, &out, outsize);
+    }else{
+        // negative window bits for a stream without the zlib framing
+        int level = globals.level == LevelFast ? MZ_BEST_SPEED : MZ_UBER_COMPRESSION;
+        int flags = tdefl_create_comp_flags_from_zip_params(level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+        out = tdefl_compress_mem_to_heap(content, len, outsize, flags);
+    }
+    return out;
+}
+
+// Frames a deflate stream the way the archive stores a sector: a zlib stream
+// behind the compression type, or the plain content if that isn't smaller.
+static unsigned char* FrameSector(const unsigned char *deflated, size_t deflatedSize, const unsigned char *content, size_t len, size_t *outsize){
+    size_t zlibSize = 2 + deflatedSize + 4;
+    unsigned char *out;
+
+    if(deflated && zlibSize < len && zlibSize <= globals.blockSize -2){
+        uint32_t adler = mz_adler32(MZ_ADLER32_INIT, content, len);
+        out = malloc(1+zlibSize);
+        out[0] = 2;
+        // the header zopfli writes
+        out[1] = 0x78;
+        out[2] = 0x01;
+        memcpy(out+3, deflated, deflatedSize);
+        out[zlibSize-3] = adler >> 24;
+        out[zlibSize-2] = (adler >> 16) & 0xFF;
+        out[zlibSize-1] = (adler >> 8) & 0xFF;
+        out[zlibSize] = adler & 0xFF;
+        *outsize = 1+zlibSize;
+    }else{
+        out = malloc(len);
+        memcpy(out, content, len);
+        *outsize = len;
+    }
+    return out;
+}
+
+// The key of a deflated sector in the caches: the hash of the content together
+// with every option that changes how it is deflated. Neither the path nor the
+// block size are part of it, so a sector is found again in any file and map.
+// Streams made from a warm start depend on the earlier runs, they are kept
+// apart from the ones made from scratch.
+void CacheKey(unsigned char key[32], const unsigned char *content, size_t len, enum Level level, int warm){
+    unsigned char buf[32 + 10*4];
+    lonesha256(buf, content, len);
+    WriteInt(buf, 32, CACHE_VERSION);
+    WriteInt(buf, 36, level);
+    WriteInt(buf, 40, globals.zopfli_options.numiterations);
+    WriteInt(buf, 44, globals.zopfli_options.blocksplitting);
+    WriteInt(buf, 48, globals.zopfli_options.blocksplittingmax);
+    WriteInt(buf, 52, globals.zopfli_options.numseeds);
+    WriteInt(buf, 56, globals.zopfli_options.stalliterations);
+    WriteInt(buf, 60, globals.zopfli_options.maxiterations);
+    WriteInt(buf, 64, globals.zopfli_options.squeezewindow);
+    WriteInt(buf, 68, warm);
+    lonesha256(key, buf, sizeof(buf));
+}
+
+// The key of the warm start of a sector in the disk cache: its path and its
+// place in the file, so it is found again after the content changed.
+static void WarmKey(unsigned char key[32], const char *path, size_t sector){
+    size_t len = strlen(path);
+    unsigned char *buf = malloc(4 + len + 12);
+    memcpy(buf, "warm", 4);
+    memcpy(buf + 4, path, len);
+    WriteInt(buf, 4 + len, sector);
+    WriteInt(buf, 8 + len, globals.blockSize);
+    WriteInt(buf, 12 + len, CACHE_VERSION);
+    lonesha256(key, buf, 4 + len + 12);
+    free(buf);
+}
+
+// A warm start is stored as the length of the sector, the number of blocks,
+// their starts and their frequencies.
+static void StoreWarmStart(const unsigned char key[32], size_t len, const ZopfliWarmStart *warm){
+    size_t size = 8 + 4*warm->nblocks*(1 + ZOPFLI_WARM_FREQS);
+    unsigned char *data = malloc(size);
+    size_t pos = 8;
+    WriteInt(data, 0, len);
+    WriteInt(data, 4, warm->nblocks);
+    for(size_t i = 0; i != warm->nblocks; i++, pos += 4)
+        WriteInt(data, pos, warm->blockstarts[i]);
+    for(size_t i = 0; i != warm->nblocks*ZOPFLI_WARM_FREQS; i++, pos += 4)
+        WriteInt(data, pos, warm->freqs[i]);
+    InsertDiskCache(&globals.diskCache, key, data, size);
+    free(data);
+}
+
+// Reads the warm start of a sector. It is only used if the sector kept about
+// its size, otherwise the old blocks would hardly fit anymore.
+static int LoadWarmStart(const unsigned char key[32], size_t len, ZopfliWarmStart *warm){
+    size_t size;
+    unsigned char *data = LookupDiskCache(&globals.diskCache, key, &size);
+    if(!data)
+        return 0;
+
+    size_t oldLen = size >= 8 ? ReadInt(data, 0) : 0;
+    size_t nblocks = size >= 8 ? ReadInt(data, 4) : 0;
+    int usable = nblocks > 0
+              && size == 8 + 4*nblocks*(1 + ZOPFLI_WARM_FREQS)
+              && len >= oldLen - oldLen/8 && len <= oldLen + oldLen/8;
+    if(usable){
+        size_t pos = 8;
+        warm->nblocks = nblocks;
+        warm->blockstarts = malloc(nblocks*sizeof(size_t));
+        warm->freqs = malloc(nblocks*ZOPFLI_WARM_FREQS*sizeof(unsigned));
+        for(size_t i = 0; i != nblocks; i++, pos += 4)
+            warm->blockstarts[i] = ReadInt(data, pos);
+        for(size_t i = 0; i != nblocks*ZOPFLI_WARM_FREQS; i++, pos += 4)
+            warm->freqs[i] = ReadInt(data, pos);
+    }
+    free(data);
+    return usable;
+}
+
+// Packs a sector as it is stored in the archive. The deflate stream comes
+// from the memory cache, the disk cache or is made anew, in that order. Only
+// zopfli streams are worth keeping on disk, the miniz tiers read them but
+// never store their own. A sector which is made anew
+// starts from the warm start of the previous version of its file if there is
+// one, so an edited file doesn't start from scratch. Such a stream is only
+// found again by runs which have a warm start for the sector as well.
+unsigned char* PackSector(const ZopfliOptions *options, const unsigned char *content, size_t len, const char *path, size_t sector, size_t *outsize){
+    unsigned char key[32];
+    unsigned char *deflated = NULL;
+    size_t deflatedSize = 0;
+    int useMemory = globals.memCache.capacity != 0;
+    int useDisk = globals.useCache && globals.level == LevelZopfli;
+
+    if(useMemory || globals.useCache)
+        CacheKey(key, content, len, globals.level, 0);
+    if(useMemory)
+        deflated = LookupMemCache(&globals.memCache, key, &deflatedSize);
+    if(!deflated && globals.useCache){
+        unsigned char zopfliKey[32];
+        CacheKey(zopfliKey, content, len, LevelZopfli, 0);
+        deflated = LookupDiskCache(&globals.diskCache, zopfliKey, &deflatedSize);
+        if(deflated && useMemory)
+            InsertMemCache(&globals.memCache, key, deflated, deflatedSize);
+    }
+    if(!deflated){
+        ZopfliOptions warmOptions = *options;
+        ZopfliWarmStart warmstart, warmresult;
+        unsigned char warmKey[32];
+        unsigned char diskKey[32];
+        ZopfliInitWarmStart(&warmstart);
+        ZopfliInitWarmStart(&warmresult);
+        memcpy(diskKey, key, 32);
+        if(useDisk){
+            WarmKey(warmKey, path, sector);
+            if(LoadWarmStart(warmKey, len, &warmstart)){
+                warmOptions.warmstart = &warmstart;
+                CacheKey(diskKey, content, len, LevelZopfli, 1);
+                deflated = LookupDiskCache(&globals.diskCache, diskKey, &deflatedSize);
+            }
+            warmOptions.warmresult = &warmresult;
         }
-        free(zopfli_out);
-    }
-    
-
-    memmove(out+offsetTableSize, out, written);
-    *outsize = written + offsetTableSize;
-    *flags = FLAG_FILE_COMPRESSED;
-    sectorOffsetTable[0] = offsetTableSize;
-    for(size_t i = 0, acc = 0; i != tableIdx; i++){
-        acc += sectorOffsetTable[i];
-        WriteInt(out, i*4, acc);
-    }
-    free(sectorOffsetTable);
-    
-}
-
-// Helper function to encode data in Base64url format (RFC 4648)
-void Base64URLEncode(char *encoded, const char *string, int len) {
-  /* Original source code taken from
-   * https://svn.apache.org/repos/asf/apr/apr/trunk/encoding/apr_base64.c
-   *
-   * Changes by Michel Lang <michellang@gmail.com>:
-   * - Replaced char 62 ('+') with '-'
-   * - Replaced char 63 ('/') with '_'
-   * - Removed padding with '=' at the end of the string
-   * - Changed return type to void for Base64encode
-   *
-   * Changes by Leonardo Julca <ivojulca@hotmail.com>:
-   * - Renamed to Base64URLEncode
-   */
-  /*
-   * base64.c:  base64 encoding and decoding functions
-   *
-   * ====================================================================
-   *    Licensed to the Apache Software Foundation (ASF) under one
-   *    or more contributor license agreements.  See the NOTICE file
-   *    distributed with this work for additional information
-   *    regarding copyright ownership.  The ASF licenses this file
-   *    to you under the Apache License, Version 2.0 (the
-   *    "License"); you may not use this file except in compliance
-   *    with the License.  You may obtain a copy of the License at
-   *
-   *      http://www.apache.org/licenses/LICENSE-2.0
-   *
-   *    Unless required by applicable law or agreed to in writing,
-   *    software distributed under the License is distributed on an
-   *    "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
-   *    KIND, either express or implied.  See the License for the
-   *    specific language governing permissions and limitations
-   *    under the License.
-   * ====================================================================
-   */
-
-    int i;
-    char *p = encoded;
-
-    for (i = 0; i < len - 2; i += 3) {
-        *p++ = Base64URLTable[(string[i] >> 2) & 0x3F];
-        *p++ = Base64URLTable[((string[i] & 0x3) << 4) | ((int) (string[i + 1] & 0xF0) >> 4)];
-        *p++ = Base64URLTable[((string[i + 1] & 0xF) << 2) | ((int) (string[i + 2] & 0xC0) >> 6)];
-        *p++ = Base64URLTable[string[i + 2] & 0x3F];
-    }
-
-    if (i < len) {
-        *p++ = Base64URLTable[(string[i] >> 2) & 0x3F];
-        if (i == (len - 1)) {
-            *p++ = Base64URLTable[((string[i] & 0x3) << 4)];
-        } else {
-            *p++ = Base64URLTable[((string[i] & 0x3) << 4) | ((int) (string[i + 1] & 0xF0) >> 4)];
-            *p++ = Base64URLTable[((string[i + 1] & 0xF) << 2)];
+
+        if(deflated){
+            if(useMemory)
+                InsertMemCache(&globals.memCache, key, deflated, deflatedSize);
+        }else{
+            deflated = DeflateSector(&warmOptions, content, len, &deflatedSize);
+            // a run cut short by the time budget would be taken for a full one
+            // by later runs without a budget
+            stopcontext_t *stop = options->stop ? options->stopcontext : NULL;
+            int complete = !stop || !stop->stopped;
+            if(deflated && useMemory)
+                InsertMemCache(&globals.memCache, key, deflated, deflatedSize);
+            if(deflated && useDisk && complete)
+                InsertDiskCache(&globals.diskCache, diskKey, deflated, deflatedSize);
+            if(warmresult.nblocks)
+                StoreWarmStart(warmKey, len, &warmresult);
         }
+        ZopfliCleanWarmStart(&warmstart);
+        ZopfliCleanWarmStart(&warmresult);
     }
 
-    *p++ = '\0';
+    unsigned char *out = FrameSector(deflated, deflatedSize, content, len, outsize);
+    free(deflated);
+    return out;
 }
 
+// Writes the sector offset table of the packed sectors to sot and returns
+// the size of the whole packed file.
+size_t BuildSectorOffsetTable(packjob_t *job, unsigned char *sot){
+    size_t outpos = 4*(1+job->numSectors);
+    WriteInt(sot, 0, outpos);
+    for(size_t i = 0; i != job->numSectors; i++){
+        outpos += job->sectorSizes[i];
+        WriteInt(sot, 4*(i+1), outpos);
+    }
+    return outpos;
+}
+
+// Opens the persistent cache in globals.cacheDir, without it the run goes on
+// uncached.
 void InitCache() {
     struct stat st = {0};
     
-    if (stat("./cache", &st) == -1) {
-        if (mkdir("./cache", 0755) != 0) {
+    if (stat(globals.cacheDir, &st) == -1) {
+        if (mkdir(globals.cacheDir, 0755) != 0) {
             perror("Failed to create cache directory");
             exit(EXIT_FAILURE);
         }
     }
+
+    if(!OpenDiskCache(&globals.diskCache, globals.cacheDir, globals.cacheSize)){
+        fprintf(stderr, "Couldn't open the cache in '%s'\n", globals.cacheDir);
+        globals.useCache = 0;
+    }
 }
 
-#ifdef _WIN32
-HANDLE CreateCacheLock(const char *path) {
-    HANDLE hFile = INVALID_HANDLE_VALUE;
-    int tries = 100;
-
-    while (tries--) {
-        hFile = CreateFile(
-            path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
-            CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL
-        );
-
-        if (hFile != INVALID_HANDLE_VALUE) {
-            return hFile;
-        }
+// zopfli is slow on data with lots of long matches and fast on data which
+// doesn't compress anyway. the input archive tells us how well each file
+// compressed before so we use that as a cheap probe on top of the size.
+static double EstimateCost(btentry_t *bte){
+    if(!bte || bte->normalSize == 0)
+        return 0;
+    double ratio = 0.5;
+    if(bte->flags & FLAG_FILE_COMPRESSED)
+        ratio = (double)bte->compressedSize / bte->normalSize;
+    if(ratio > 1)
+        ratio = 1;
+    return bte->normalSize * (2 - ratio);
+}
 
-        if (GetLastError() == ERROR_FILE_EXISTS) {
-            sleep_ms(10);
-        } else {
-            break;
-        }
-    }
+static int CompareCost(const void *a, const void *b){
+    double ca = ((const packjob_t*)a)->cost,
+           cb = ((const packjob_t*)b)->cost;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
 
-    return hFile;
+void InitPackJob(packjob_t *job, char *path){
+    btentry_t *bte = FindBTE(&globals.inMpq.tbl, path);
+
+    memset(job, 0, sizeof(packjob_t));
+    job->path = path;
+    job->lock = Sys_CreateLock();
+    job->insize = bte ? bte->normalSize : 0;
+    job->cost = EstimateCost(bte);
+    // every sector job decodes only its own part of the file. single unit
+    // files can't be decoded in parts and input sectors larger than ours
+    // would be decoded over and over, so those are extracted at once.
+    job->streamed = bte
+                 && !(bte->flags & FLAG_FILE_SINGLE_UNIT)
+                 && 512u * (1 << globals.inMpq.hd.shift) <= globals.blockSize;
+    job->numSectors = (job->insize + globals.blockSize - 1) / globals.blockSize;
+    // empty files still need one job so they get written
+    job->pending = job->numSectors ? job->numSectors : 1;
+    job->sectors = calloc(job->numSectors, sizeof(unsigned char*));
+    job->sectorSizes = calloc(job->numSectors, sizeof(size_t));
 }
 
-void ReleaseCacheLock(HANDLE hFile, const char *path) {
-    CloseHandle(hFile);
-    DeleteFile(path);
+static int CompareSize(const void *a, const void *b){
+    const packjob_t *ja = *(const packjob_t**)a, *jb = *(const packjob_t**)b;
+    if(ja->insize != jb->insize)
+        return ja->insize < jb->insize ? -1 : 1;
+    // files of the same size stay in packing order, so the first one to be
+    // packed is the original of its duplicates
+    return ja < jb ? -1 : ja > jb ? 1 : 0;
 }
-#else
-int CreateCacheLock(const char *path) {
-    int fd = -1;
-    int tries = 100;
 
-    while (tries--) {
-        fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0666);
-        if (fd != -1) return fd;
-        sleep_ms(10);
+// Picks the files which might have the same content as another one, like a
+// texture imported under two paths. Only files of equal size can, which are
+// few. They are grouped by size and hashed by HashFiles.
+static void SelectHashed(packjob_t *files, size_t cnt){
+    packjob_t **bySize = malloc(cnt*sizeof(packjob_t*));
+    size_t n = 0;
+
+    for(size_t i = 0; i != cnt; i++)
+        bySize[i] = &files[i];
+    qsort(bySize, cnt, sizeof(packjob_t*), CompareSize);
+
+    for(size_t i = 0, j; i != cnt; i = j){
+        for(j = i+1; j != cnt && bySize[j]->insize == bySize[i]->insize; j++)
+            ;
+        if(j - i < 2 || bySize[i]->insize == 0)
+            continue;
+        for(size_t k = i; k != j; k++)
+            bySize[n++] = bySize[k];
     }
 
-    return fd;
+    globals.hashed = bySize;
+    globals.numHashed = n;
+    globals.hashes = malloc(n*sizeof(*globals.hashes));
 }
 
-void ReleaseCacheLock(int fd, const char *path){
-    close(fd);
-    unlink(path);
-}
+// Finds the hashed files with the same content. The output is never encrypted
+// so the duplicates can share the block of their original.
+static size_t FindDuplicates(void){
+    packjob_t **hashed = globals.hashed;
+    unsigned char (*hashes)[32] = globals.hashes;
+    size_t duplicates = 0;
+
+    for(size_t i = 0, j; i != globals.numHashed; i = j){
+        for(j = i+1; j != globals.numHashed && hashed[j]->insize == hashed[i]->insize; j++)
+            ;
+        for(size_t k = i; k != j; k++){
+            packjob_t *job = hashed[k];
+            for(size_t l = i; l != k; l++){
+                if(!hashed[l]->original && !memcmp(hashes[k], hashes[l], 32)){
+                    job->original = hashed[l];
+                    break;
+                }
+            }
+            if(job->original){
+                printf("%s is the same as %s\n", job->path, job->original->path);
+                // nothing to pack
+                job->pending = 0;
+                free(job->sectors);
+                free(job->sectorSizes);
+                job->sectors = NULL;
+                job->sectorSizes = NULL;
+                duplicates++;
+            }
+        }
+    }
 
-#endif
+    free(hashes);
+    free(hashed);
+    return duplicates;
+}
 
-void CachePacked(const char *path, const unsigned char *out, const size_t outsize, const unsigned char *content, const size_t insize){
-    char lock_path[1024];
-    char cache_path[1019];
+static void PrepareJob(packjob_t *job){
+    size_t insize;
 
-    {
-      char in_archive_path64[966];
-      char content_hash64[45];
-      char content_hash[32];
+    job->startTime = Seconds();
+    if(!OpenMpqFile(globals.inMpq.mpq, &globals.inMpq.hd, &globals.inMpq.tbl, job->path, &job->in))
+        exit(1);
 
-      // Construct the full file path: "{CWD}/cache/{content_hash64}-{in_archive_path64}"
-      lonesha256(content_hash, content, insize);
-      Base64URLEncode(content_hash64, content_hash, sizeof(content_hash));
-      Base64URLEncode(in_archive_path64, path, strlen(path));
-      snprintf(cache_path, sizeof(cache_path), "./cache/%s-%s", content_hash64, in_archive_path64);
-      snprintf(lock_path, sizeof(lock_path), "%s.lock", cache_path);
+    if(job->streamed){
+        job->extracted = 1;
+        return;
     }
 
+    job->content = ExtractFileView(globals.inMpq.mpq, &globals.inMpq.hd, &globals.inMpq.tbl, job->path, &insize, &job->borrowed);
+    if(!job->content)
+        exit(1);
+    assert(insize == job->insize);
+    job->extracted = 1;
+}
+
+// writes at an absolute position of the output file without touching the
+// shared FILE position, so threads can write concurrently
+static void WriteAt(const void *data, size_t size, size_t offset){
 #ifdef _WIN32
-    HANDLE lock = CreateCacheLock(lock_path);
-    if (lock == INVALID_HANDLE_VALUE){
+    HANDLE hFile = (HANDLE)_get_osfhandle(fileno(globals.mpq_file));
+    OVERLAPPED ov = {0};
+    DWORD written;
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+    if(!WriteFile(hFile, data, size, &written, &ov) || written != size){
+        fprintf(stderr, "Couldn't write to the output file\n");
+        exit(1);
+    }
 #else
-    int lock = CreateCacheLock(lock_path);
-    if (lock == -1){
-#endif
-        printf("Cache file is locked (%s)", lock_path);
-        return;
+    const char *p = data;
+    while(size > 0){
+        ssize_t n = pwrite(fileno(globals.mpq_file), p, size, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0){
+            perror("Couldn't write to the output file");
+            exit(1);
+        }
+        p += n;
+        size -= n;
+        offset += n;
     }
+#endif
+}
 
-    // Open the file for writing (create if not exists, overwrite if exists)
-    FILE *file = fopen(cache_path, "wb");
-    if(!file) {
-        perror("Failed to update cache file");
-        ReleaseCacheLock(lock, lock_path);
-        return;
+// Writes the packed sectors one after another straight into the archive
+// instead of assembling a copy of the whole file first.
+static size_t WriteSectors(packjob_t *job){
+    size_t offsetTableSize = 4*(1+job->numSectors);
+    unsigned char *sot = malloc(offsetTableSize);
+    job->outsize = BuildSectorOffsetTable(job, sot);
+    job->flags = FLAG_FILE_COMPRESSED;
+
+    size_t filePos = Sys_AtomicAdd(&globals.bytesWritten, job->outsize) - job->outsize;
+    size_t offset = globals.inMpq.offset + filePos;
+    WriteAt(sot, offsetTableSize, offset);
+    offset += offsetTableSize;
+    for(size_t i = 0; i != job->numSectors; i++){
+        WriteAt(job->sectors[i], job->sectorSizes[i], offset);
+        offset += job->sectorSizes[i];
+        free(job->sectors[i]);
     }
+    free(sot);
+    return filePos;
+}
 
-    int success = 0;
-    if(fwrite(out, sizeof(unsigned char), outsize, file) == outsize) {
-        success = 1;
+// A rough upper bound of the memory packing a sector takes while it is
+// packed, and in held what it keeps until its file is written: the part of
+// the extracted content it covers and the packed sector, which is at most
+// about as big as the input. A streamed sector decodes its input into a
+// buffer of its own. Zopfli squeezes one window at a time with about 80
+// bytes per byte and the match table of the window with about 24 more. The
+// LZ77 stores of the pieces and the one they are concatenated into take 19
+// bytes per symbol each, which is at most one per byte. miniz needs little
+// besides the buffers.
+static uint64_t EstimateMemory(packjob_t *job, size_t sector, uint64_t *held){
+    *held = 0;
+    if(sector >= job->numSectors)
+        return 0;
+    size_t start = sector * globals.blockSize;
+    uint64_t len = job->insize-start > globals.blockSize ? globals.blockSize : job->insize-start;
+    uint64_t input = job->streamed ? len + 512u * (1 << globals.inMpq.hd.shift) : 0;
+    *held = (job->streamed ? 0 : len) + len;
+    if(globals.level != LevelZopfli)
+        return input + 2*len;
+
+    uint64_t window = globals.zopfli_options.squeezewindow;
+    uint64_t squeeze = window && window < len ? window : len;
+    return input + 2*len + 2*19*len + (80+24)*squeeze;
+}
+
+// Admits a job if it fits into the memory limit next to the running ones and
+// the files which aren't written yet. A job which doesn't fit at all is
+// admitted once nothing else runs, so files waiting for their last sectors
+// always get them.
+static int Admit(sectorjob_t *sj){
+    if(!globals.memoryLimit)
+        return 1;
+    for(;;){
+        uint64_t used = Sys_AtomicLoad64(&globals.memoryUsed);
+        uint64_t held = Sys_AtomicLoad64(&globals.memoryHeld);
+        if(used != 0 && used + held + sj->memory + sj->held > globals.memoryLimit)
+            return 0;
+        if(Sys_AtomicCAS64(&globals.memoryUsed, used, used + sj->memory))
+            break;
+    }
+    for(;;){
+        uint64_t held = Sys_AtomicLoad64(&globals.memoryHeld);
+        if(Sys_AtomicCAS64(&globals.memoryHeld, held, held + sj->held))
+            return 1;
     }
-    fclose(file);
+}
 
-    if(success == 0) {
-        remove(cache_path);
-        perror("Failed to update cache file");
+static void Release(volatile uint64_t *counter, uint64_t memory){
+    if(!globals.memoryLimit)
+        return;
+    for(;;){
+        uint64_t used = Sys_AtomicLoad64(counter);
+        if(Sys_AtomicCAS64(counter, used, used - memory))
+            return;
     }
-    ReleaseCacheLock(lock, lock_path);
 }
 
-int ReadCache(char *path, const size_t insize, const unsigned char *content, unsigned char *out, size_t *outsize, uint32_t *flags){
-    char lock_path[1024];
-    char cache_path[1019];
+static void WriteJob(int threadId, packjob_t *job){
+    // reserve our spot in the archive, the block table entries are inserted
+    // all at once after every thread is done
+    size_t filePos = WriteSectors(job);
 
-    {
-      char in_archive_path64[966];
-      char content_hash64[45];
-      char content_hash[32];
+    job->bte.filePos = filePos;
+    job->bte.compressedSize = job->outsize;
+    job->bte.normalSize = job->insize;
+    job->bte.flags = job->flags | FLAG_FILE_EXISTS;
 
-      // Construct the full file path: "{CWD}/cache/{content_hash64}-{in_archive_path64}"
-      lonesha256(content_hash, content, insize);
-      Base64URLEncode(content_hash64, content_hash, sizeof(content_hash));
-      Base64URLEncode(in_archive_path64, path, strlen(path));
-      snprintf(cache_path, sizeof(cache_path), "./cache/%s-%s", content_hash64, in_archive_path64);
-      snprintf(lock_path, sizeof(lock_path), "%s.lock", cache_path);
-    }
+    Sys_AtomicAdd(&globals.totalInSize, job->insize);
+    Sys_AtomicAdd(&globals.totalOutSize, job->outsize);
 
-#ifdef _WIN32
-    HANDLE lock = CreateCacheLock(lock_path);
-    if (lock == INVALID_HANDLE_VALUE){
-#else
-    int lock = CreateCacheLock(lock_path);
-    if (lock == -1){
-#endif
-        printf("Cache file is locked (%s)", lock_path);
-        return 0;
-    }
+    size_t status = Sys_AtomicAdd(&globals.filesProceeded, 1) - 1;
 
-    // For reading and writing, only if it exists.
-    FILE *file = fopen(cache_path, "rb+");
-    if (!file) {
-        ReleaseCacheLock(lock, lock_path);
-        return 0;
+    printf("@%d [%d/%d] Finished %s (%f)\n", threadId, status, globals.numFiles, job->path, (float)job->outsize/job->insize);
+
+    if(!job->borrowed)
+        free(job->content);
+    free(job->sectors);
+    free(job->sectorSizes);
+    CloseMpqFile(&job->in);
+    job->content = NULL;
+    Release(&globals.memoryHeld, job->held);
+}
+
+// Wakes up the threads in WaitForWork and those waiting for their tasks.
+static void NotifyWork(void){
+    Sys_Lock(globals.workLock);
+    globals.workEpoch++;
+    Sys_Broadcast(globals.workCond);
+    Sys_Unlock(globals.workLock);
+}
+
+// Sleeps until NotifyWork is called, unless it was since epoch was read.
+static void WaitForWork(size_t epoch){
+    Sys_Lock(globals.workLock);
+    while(globals.workEpoch == epoch)
+        Sys_Wait(globals.workCond, globals.workLock);
+    Sys_Unlock(globals.workLock);
+}
+
+static void RunTask(task_t *t, ZopfliScratch *scratch){
+    taskbatch_t *batch = t->batch;
+    batch->task(batch->context, t->index, scratch);
+    Sys_AtomicAdd(&batch->done, 1);
+}
+
+// Runs the tasks zopfli hands out for a sector. They are pushed to the deque
+// of the calling thread so that threads which ran out of sectors can steal
+// some of them, the calling thread takes the rest back and works on them
+// itself. it only runs its own tasks, the scratch memory of this thread may
+// still be in use by the caller.
+static void RunParallel(ZopfliTask *task, void *context, size_t n){
+    taskbatch_t batch = {task, context, 0};
+    task_t *tasks = malloc(n*sizeof(task_t));
+    ZopfliScratch *scratch = globals.scratches[Sys_ThreadIndex()];
+
+    for(size_t i = 0; i != n; i++){
+        tasks[i].batch = &batch;
+        tasks[i].index = i;
+        if(!push(&globals.task_queue, &tasks[i]))
+            RunTask(&tasks[i], scratch);
     }
+    NotifyWork();
 
-    fseek(file, 0, SEEK_END);
-    *outsize = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    // the tasks are the last ones on the deque, the ones we can't take back
+    // were stolen
+    for(size_t i = n; i-- != 0;){
+        if(unpush(&globals.task_queue, &tasks[i]))
+            RunTask(&tasks[i], scratch);
+    }
 
-    fread(out, sizeof(unsigned char), *outsize, file);
-    fclose(file);
+    // wait for the tasks other threads took
+    Sys_Lock(globals.workLock);
+    while(Sys_AtomicAdd(&batch.done, 0) != n)
+        Sys_Wait(globals.workCond, globals.workLock);
+    Sys_Unlock(globals.workLock);
+    free(tasks);
+}
 
-    // TODO:
-    // Validate file content, but collisions are unlikely
+// The next job which fits into memory. Jobs which had to wait go first, in
+// the order they were deferred in, which is biggest first. Jobs from the
+// queue which don't fit are deferred and smaller ones are tried meanwhile.
+static sectorjob_t* NextJob(void){
+    sectorjob_t *sj = NULL;
+
+    if(globals.numDeferred){
+        Sys_Lock(globals.deferLock);
+        for(size_t i = 0; i != globals.numDeferred; i++){
+            if(Admit(globals.deferred[i])){
+                sj = globals.deferred[i];
+                memmove(&globals.deferred[i], &globals.deferred[i+1], (globals.numDeferred-i-1)*sizeof(sectorjob_t*));
+                globals.numDeferred--;
+                break;
+            }
+        }
+        Sys_Unlock(globals.deferLock);
+        if(sj)
+            return sj;
+    }
 
-    // Match flags set by PackFile
-    *flags = FLAG_FILE_COMPRESSED; 
+    while((sj = pop(&globals.work_queue, NULL)) != NULL){
+        if(Admit(sj))
+            return sj;
+        Sys_Lock(globals.deferLock);
+        globals.deferred[globals.numDeferred++] = sj;
+        Sys_Unlock(globals.deferLock);
+    }
+    return NULL;
+}
 
-    // Bump atime, mtime
-    utime(cache_path, NULL);
+// ZopfliStopFun, ends the iterations of a sector once the time of the whole
+// run or of its file is used up. the sectors after that still get one
+// iteration each, so files which are packed first get the most time.
+int OutOfTime(void *context){
+    stopcontext_t *stop = context;
+    double now = Seconds();
+
+    if((globals.timeBudget > 0 && now - globals.startTime >= globals.timeBudget)
+    || (globals.fileTime > 0 && now - stop->job->startTime >= globals.fileTime)){
+        stop->stopped = 1;
+        return 1;
+    }
+    return 0;
+}
 
-    ReleaseCacheLock(lock, lock_path);
+// Queues a job for every sector of the files which aren't duplicates.
+static void QueueJobs(void){
+    packjob_t *files = globals.files;
+    size_t numJobs = 0;
+    for(size_t i = 0; i != globals.numFiles; i++)
+        numJobs += files[i].pending;
+    sectorjob_t *jobs = malloc(sizeof(sectorjob_t)*numJobs);
+    for(size_t i = 0, j = 0; i != globals.numFiles; i++){
+        for(size_t s = 0; s != files[i].pending; s++, j++){
+            jobs[j].file = &files[i];
+            jobs[j].sector = s;
+            jobs[j].memory = EstimateMemory(&files[i], s, &jobs[j].held);
+            files[i].held += jobs[j].held;
+        }
+    }
+    globals.sectorsPending = numJobs;
+    globals.deferLock = Sys_CreateLock();
+    globals.deferred = malloc(numJobs*sizeof(sectorjob_t*));
+    globals.numDeferred = 0;
 
-    return 1;
+    InitWorkQueue(&globals.work_queue, jobs, numJobs, sizeof(sectorjob_t), globals.numThreads, 0);
 }
 
-void PackFiles(void *arguments){
-    int threadId = *(int*)arguments;
-    char **path;
-    //size_t status;
-    while((path = pop(&globals.work_queue, NULL)) != NULL){
-        //printf("@%d [%d/%d] Starting %s...\n", threadId, status, globals.work_queue.size, *path);
-        
+// Every thread hashes the next of the files SelectHashed picked until none is
+// left. The last thread to run out finds the duplicates and queues the sector
+// jobs, the others wait for it.
+static void HashFiles(void){
+    size_t k;
+    while((k = Sys_AtomicAdd(&globals.nextHash, 1) - 1) < globals.numHashed){
+        packjob_t *job = globals.hashed[k];
         size_t insize;
-        size_t outsize = 0;
-        char *content = ExtractFile(globals.inMpq.mpq, &globals.inMpq.hd, &globals.inMpq.tbl, *path, &insize);
+        int borrowed;
+        char *content = ExtractFileView(globals.inMpq.mpq, &globals.inMpq.hd, &globals.inMpq.tbl, job->path, &insize, &borrowed);
         if(!content)
             exit(1);
-        size_t sotSize = 4*(1+ ceil( ((float)insize)/globals.blockSize ));
-        unsigned char *out = malloc(insize + sotSize);
-        uint32_t flags;
-        int foundCache = 0;
+        lonesha256(globals.hashes[k], (unsigned char*)content, insize);
+        if(!borrowed)
+            free(content);
+    }
+
+    if(Sys_AtomicAdd(&globals.threadsHashed, 1) == (size_t)globals.numThreads){
+        globals.filesProceeded += FindDuplicates();
+        QueueJobs();
+        Sys_AtomicAdd(&globals.jobsQueued, 1);
+        NotifyWork();
+        return;
+    }
+    for(;;){
+        size_t epoch = Sys_AtomicAdd(&globals.workEpoch, 0);
+        if(Sys_AtomicAdd(&globals.jobsQueued, 0))
+            return;
+        WaitForWork(epoch);
+    }
+}
 
-        if(globals.useCache) {
-            foundCache = ReadCache(*path, (const size_t)insize, (const unsigned char*)content, out, &outsize, &flags);
+void PackFiles(void *arguments){
+    int threadId = *(int*)arguments;
+    sectorjob_t *sj;
+
+    // every thread gets its own scratch memory for zopfli which is reused
+    // for all the sectors it packs
+    ZopfliOptions options = globals.zopfli_options;
+    options.scratch = globals.scratches[Sys_ThreadIndex()];
+
+    HashFiles();
+    for(;;){
+        size_t epoch = Sys_AtomicAdd(&globals.workEpoch, 0);
+        sj = NextJob();
+        if(!sj){
+            if(Sys_AtomicAdd(&globals.sectorsPending, 0) == 0)
+                break;
+            // nothing we may start right now, help the threads which are
+            // still packing or sleep until a job finishes
+            task_t *t = pop(&globals.task_queue, NULL);
+            if(t){
+                RunTask(t, options.scratch);
+                NotifyWork();
+            }else{
+                WaitForWork(epoch);
+            }
+            continue;
         }
-        if(foundCache == 0){
-            PackFile((unsigned char*)content, insize, insize + sotSize, out, &outsize, &flags);
-            if (globals.useCache){
-                CachePacked(*path, out, outsize, content, insize);
+        packjob_t *job = sj->file;
+
+        // the first thread to reach a file extracts it, everyone else
+        // working on the same file waits for it here.
+        Sys_Lock(job->lock);
+        if(!job->extracted)
+            PrepareJob(job);
+        Sys_Unlock(job->lock);
+
+        if(sj->sector < job->numSectors){
+            size_t start = sj->sector * globals.blockSize;
+            size_t len = job->insize-start > globals.blockSize ? globals.blockSize : job->insize-start;
+            char *buffer = NULL;
+            char *data;
+            if(job->content){
+                data = job->content + start;
+            }else{
+                buffer = malloc(len + job->in.sectorSize);
+                data = ReadRange(&job->in, start, len, buffer);
+                if(!data)
+                    exit(1);
             }
+            stopcontext_t stop = {job, 0};
+            options.stopcontext = &stop;
+            job->sectors[sj->sector] = PackSector(&options, (unsigned char*)data, len, job->path, sj->sector, &job->sectorSizes[sj->sector]);
+            free(buffer);
         }
 
-        Sys_Lock(globals.lock);
+        Sys_Lock(job->lock);
+        int last = --job->pending == 0;
+        Sys_Unlock(job->lock);
 
-        fwrite(out, outsize, 1, globals.mpq_file);
-        
-        btentry_t bte;
-        bte.filePos = globals.bytesWritten;
-        bte.compressedSize = outsize;
-        bte.normalSize = insize;
-        bte.flags = flags | FLAG_FILE_EXISTS;
-
-        ConvertSlashes(*path);
-        Insert(&globals.mpq_table, *path, &bte);
-        globals.bytesWritten += outsize;
-
-        globals.totalInSize += insize;
-        globals.totalOutSize += outsize;
-        
-        size_t status = globals.filesProceeded++;
-        
-        printf("@%d [%d/%d] Finished %s (%f)\n", threadId, status, globals.work_queue.size, *path, (float)outsize/insize);
-        
-        Sys_Unlock(globals.lock);
-        
-        free(content);
-        free(out);
-    }
+        if(last)
+            WriteJob(threadId, job);
 
+        Release(&globals.memoryUsed, sj->memory);
+        Sys_AtomicAdd(&globals.sectorsPending, (size_t)-1);
+        NotifyWork();
+    }
 }
 
 
 
 void mkmpq(int num_threads){
-    fseek(globals.mpq_file, 0x20, SEEK_CUR);
-    
+    // everything up to here went through stdio, the files are written
+    // with WriteAt
+    fflush(globals.mpq_file);
+
     globals.bytesWritten = 0x20;
     globals.totalInSize = 0;
     globals.totalOutSize = 0;
-    
+
+    // threads are numbered from 0 with the main thread, see Sys_ThreadIndex
+    globals.numThreads = num_threads;
+    globals.scratches = malloc(num_threads*sizeof(ZopfliScratch*));
+    for(int i = 0; i != num_threads; i++)
+        globals.scratches[i] = ZopfliCreateScratch();
+    InitWorkQueue(&globals.task_queue, NULL, 0, sizeof(task_t), num_threads, TASK_CAPACITY);
+    globals.workLock = Sys_CreateLock();
+    globals.workCond = Sys_CreateCond();
+    if(num_threads > 1)
+        globals.zopfli_options.parallel = RunParallel;
+    globals.startTime = Seconds();
+    if(globals.timeBudget > 0 || globals.fileTime > 0)
+        globals.zopfli_options.stop = OutOfTime;
     
     sys_thread_t *threads;
     int *thread_args = malloc(num_threads*sizeof(int));
@@ -808,7 +1513,23 @@ void mkmpq(int num_threads){
             Sys_JoinThread(threads[i]);
         }
     }
+    for(int i = 0; i != num_threads; i++)
+        ZopfliDestroyScratch(globals.scratches[i]);
+    FreeMemCache(&globals.memCache);
+    if(globals.useCache)
+        CloseDiskCache(&globals.diskCache);
+
+    for(size_t i = 0; i != globals.numFiles; i++){
+        packjob_t *job = &globals.files[i];
+        if(job->original){
+            job->bte = job->original->bte;
+            globals.totalInSize += job->insize;
+        }
+        ConvertSlashes(job->path);
+        Insert(&globals.mpq_table, job->path, &job->bte);
+    }
 
+    fseek(globals.mpq_file, globals.inMpq.offset + globals.bytesWritten, SEEK_SET);
     WriteHT();
     WriteBT();
     WriteHeader();
@@ -825,7 +1546,7 @@ void CopyPreMPQData(){
 }
 
 void ReadInMpq(const char *path){
-    globals.inMpq.file = Sys_ReadFile(path, &globals.inMpq.size);
+    globals.inMpq.file = Sys_MapFile(path, &globals.inMpq.size);
     globals.inMpq.offset = FindHeader( globals.inMpq.file
                                      , globals.inMpq.size
                                      , &globals.inMpq.hd );
@@ -834,18 +1555,30 @@ void ReadInMpq(const char *path){
         exit(1);
     }
     globals.inMpq.mpq = globals.inMpq.file + globals.inMpq.offset;
+
+    size_t htBytes = sizeof(htentry_t) * globals.inMpq.hd.htSize;
+    size_t btBytes = sizeof(btentry_t) * globals.inMpq.hd.btSize;
+    if(globals.inMpq.offset + globals.inMpq.hd.htPos + htBytes > globals.inMpq.size
+    || globals.inMpq.offset + globals.inMpq.hd.btPos + btBytes > globals.inMpq.size){
+        fprintf(stderr, "%s seems to be truncated\n", path);
+        exit(1);
+    }
+
+    // the input is mapped read-only, the tables are decrypted into their
+    // own buffers
+    globals.inMpq.tbl.htSize = globals.inMpq.hd.htSize;
+    globals.inMpq.tbl.btSize = globals.inMpq.hd.btSize;
+    globals.inMpq.tbl.ht = malloc(htBytes);
+    globals.inMpq.tbl.bt = malloc(btBytes);
+    memcpy(globals.inMpq.tbl.ht, globals.inMpq.mpq + globals.inMpq.hd.htPos, htBytes);
+    memcpy(globals.inMpq.tbl.bt, globals.inMpq.mpq + globals.inMpq.hd.btPos, btBytes);
     
-    DecryptBlock( globals.inMpq.mpq + globals.inMpq.hd.htPos
-                , sizeof(htentry_t) * globals.inMpq.hd.htSize
+    DecryptBlock( globals.inMpq.tbl.ht
+                , htBytes
                 , hash("(hash table)", TableKey) );
-    DecryptBlock( globals.inMpq.mpq + globals.inMpq.hd.btPos
-                , sizeof(btentry_t) * globals.inMpq.hd.btSize
+    DecryptBlock( globals.inMpq.tbl.bt
+                , btBytes
                 , hash("(block table)", TableKey));
-    
-    globals.inMpq.tbl.htSize = globals.inMpq.hd.htSize;
-    globals.inMpq.tbl.btSize = globals.inMpq.hd.btSize;
-    globals.inMpq.tbl.ht = (htentry_t*)(globals.inMpq.mpq + globals.inMpq.hd.htPos);
-    globals.inMpq.tbl.bt = (btentry_t*)(globals.inMpq.mpq + globals.inMpq.hd.btPos);
 }
 
 void PopulateListfile(const char *path){
@@ -876,7 +1609,7 @@ void PopulateListfile(const char *path){
 }
 
 void PrintHelp(char *name){
-    printf("Usage: %s [--threads | -t THREADS] [--iterations | -i ITERATIONS] [--listfile | -l listfile] [--shift-size | -s shiftsize] [--block-splitting-max iterations] in-file out-file\n", name);
+    printf("Usage: %s [--threads | -t THREADS] [--iterations | -i ITERATIONS] [--listfile | -l listfile] [--shift-size | -s shiftsize] [--block-splitting-max iterations] [--seeds seeds] [--level fast|max|zopfli|N] [--patience iterations] [--max-iterations iterations] [--time-budget seconds] [--file-time seconds] [--memory-limit megabytes] [--squeeze-window kilobytes] [--memory-cache megabytes] [--cache | -c] [--cache-dir dir] [--cache-size megabytes] in-file out-file\n", name);
     printf("  in-file:                The input mpq\n");
     printf("  out-file:               The compressed mpq\n");
     printf("  --threads,  -t:         How many threads are started. Default: 2.\n");
@@ -884,7 +1617,30 @@ void PrintHelp(char *name){
     printf("  --shift-size, -s:       Sets the Blocksize to 512*2^shiftsize. Default shiftsize: 15\n");
     printf("  --block-splitting-max:  Maximum amount of blocks to split into (0 for unlimited, but this can give\n"
            "                          extreme results that hurt compression on some files). Default value: 15.\n");
+    printf("  --seeds:                How many differently seeded iteration runs are tried on every block, the\n"
+           "                          best one is kept. Idle threads run them in parallel. Default: 1.\n");
+    printf("  --level:                fast and max use the much quicker but weaker deflate of miniz, handy for\n"
+           "                          development builds. zopfli spends --iterations on every sector, a number N\n"
+           "                          is zopfli with N iterations. With --cache fast and max use the zopfli\n"
+           "                          results of earlier runs. Default: zopfli.\n");
+    printf("  --patience:             Stops iterating on a block after this many iterations without gain, so\n"
+           "                          converged blocks finish early. 0 always runs --iterations. Default: 0.\n");
+    printf("  --max-iterations:       With --patience blocks which still shrink may go on up to this many\n"
+           "                          iterations. Default: --iterations.\n");
+    printf("  --time-budget:          Seconds the whole run may spend on iterations, after that every block\n"
+           "                          ends after its current iteration. Default: unlimited.\n");
+    printf("  --file-time:            The same as --time-budget for every single file. Default: unlimited.\n");
     printf("  --cache, -c:            Use an in-disk cache to speed up later executions.\n");
+    printf("  --cache-dir:            Directory of the cache, implies --cache. Default: ./cache\n");
+    printf("  --cache-size:           Megabytes the cache may use, the least recently used files are dropped\n"
+           "                          at the end of a run. Default: 1024.\n");
+    printf("  --memory-limit:         Megabytes all threads together may use for packing. Sectors which\n"
+           "                          don't fit wait while smaller ones are packed. Default: unlimited.\n");
+    printf("  --squeeze-window:       Kilobytes of a block squeezed at once, bigger blocks are squeezed in\n"
+           "                          pieces. Bounds the memory of each thread, 0 squeezes blocks whole.\n"
+           "                          Default: 1024.\n");
+    printf("  --memory-cache:         Megabytes of packed sectors kept in memory, so content which occurs\n"
+           "                          several times is packed once. 0 disables it. Default: 64.\n");
     printf("  --help, -h:             Prints this help.\n");
 }
 
@@ -892,6 +1648,7 @@ int main(int argc, char **argv){
     size_t threads = 2;
     int shift = 15;
     int cache = 0;
+    size_t memCache = 64;
     char *external_listfile_path = NULL, *inmpq_path, *outmpq_path;
     
     globals.zopfli_options.verbose = 0;
@@ -899,6 +1656,13 @@ int main(int argc, char **argv){
     globals.zopfli_options.numiterations = 15;
     globals.zopfli_options.blocksplitting = 1;
     globals.zopfli_options.blocksplittingmax  = 15;
+    globals.zopfli_options.numseeds = 1;
+    globals.zopfli_options.stalliterations = 0;
+    globals.zopfli_options.maxiterations = 0;
+    globals.zopfli_options.squeezewindow = 1 << 20;
+    globals.level = LevelZopfli;
+    globals.cacheDir = "./cache";
+    globals.cacheSize = (uint64_t)1024 << 20;
     
     globals.filesProceeded = 1;
     
@@ -945,6 +1709,75 @@ int main(int argc, char **argv){
                 printf("The number of block must be greater than 0\n");
                 exit(0);
             }
+        } else if(!strcmp("--seeds", argv[arg])){
+            arg++;
+            if(arg >= argc){
+                printf("--seeds requires one more argument.\n");
+                exit(0);
+            }
+            globals.zopfli_options.numseeds = atoi(argv[arg]);
+            if(globals.zopfli_options.numseeds <= 0){
+                printf("The number of seeds must be greater than 0\n");
+                exit(0);
+            }
+        } else if(!strcmp("--patience", argv[arg])){
+            arg++;
+            if(arg >= argc){
+                printf("--patience requires one more argument.\n");
+                exit(0);
+            }
+            globals.zopfli_options.stalliterations = atoi(argv[arg]);
+            if(globals.zopfli_options.stalliterations < 0){
+                printf("The patience must not be negative\n");
+                exit(0);
+            }
+        } else if(!strcmp("--max-iterations", argv[arg])){
+            arg++;
+            if(arg >= argc){
+                printf("--max-iterations requires one more argument.\n");
+                exit(0);
+            }
+            globals.zopfli_options.maxiterations = atoi(argv[arg]);
+            if(globals.zopfli_options.maxiterations <= 0){
+                printf("The number of iterations must be greater than 0\n");
+                exit(0);
+            }
+        } else if(!strcmp("--time-budget", argv[arg]) || !strcmp("--file-time", argv[arg])){
+            int budget = !strcmp("--time-budget", argv[arg]);
+            arg++;
+            if(arg >= argc){
+                printf("%s requires one more argument.\n", argv[arg-1]);
+                exit(0);
+            }
+            double seconds = atof(argv[arg]);
+            if(seconds <= 0){
+                printf("The time must be greater than 0\n");
+                exit(0);
+            }
+            if(budget)
+                globals.timeBudget = seconds;
+            else
+                globals.fileTime = seconds;
+        } else if(!strcmp("--level", argv[arg])){
+            arg++;
+            if(arg >= argc){
+                printf("--level requires one more argument.\n");
+                exit(0);
+            }
+            if(!strcmp("fast", argv[arg])){
+                globals.level = LevelFast;
+            } else if(!strcmp("max", argv[arg])){
+                globals.level = LevelMax;
+            } else if(!strcmp("zopfli", argv[arg])){
+                globals.level = LevelZopfli;
+            } else if(atoi(argv[arg]) > 0){
+                // zopfli with that many iterations
+                globals.level = LevelZopfli;
+                globals.zopfli_options.numiterations = atoi(argv[arg]);
+            } else {
+                printf("The level must be fast, max, zopfli or a number of zopfli iterations\n");
+                exit(0);
+            }
         } else if(!strcmp("--shift-size", argv[arg]) || !strcmp("-s", argv[arg])){
             arg++;
             if(arg >= argc){
@@ -957,6 +1790,58 @@ int main(int argc, char **argv){
                 printf("The number of block must be betwee 1 and 15\n");
                 exit(0);
             }
+        } else if(!strcmp("--memory-limit", argv[arg])){
+            arg++;
+            if(arg >= argc){
+                printf("--memory-limit requires one more argument.\n");
+                exit(0);
+            }
+            if(atoi(argv[arg]) < 0){
+                printf("The memory limit must not be negative\n");
+                exit(0);
+            }
+            globals.memoryLimit = (uint64_t)atoi(argv[arg]) << 20;
+        } else if(!strcmp("--squeeze-window", argv[arg])){
+            arg++;
+            if(arg >= argc){
+                printf("--squeeze-window requires one more argument.\n");
+                exit(0);
+            }
+            if(atoi(argv[arg]) < 0){
+                printf("The squeeze window must not be negative\n");
+                exit(0);
+            }
+            globals.zopfli_options.squeezewindow = (size_t)atoi(argv[arg]) << 10;
+        } else if(!strcmp("--memory-cache", argv[arg])){
+            arg++;
+            if(arg >= argc){
+                printf("--memory-cache requires one more argument.\n");
+                exit(0);
+            }
+            if(atoi(argv[arg]) < 0){
+                printf("The memory cache size must not be negative\n");
+                exit(0);
+            }
+            memCache = atoi(argv[arg]);
+        } else if(!strcmp("--cache-dir", argv[arg])){
+            arg++;
+            if(arg >= argc){
+                printf("--cache-dir requires one more argument.\n");
+                exit(0);
+            }
+            globals.cacheDir = argv[arg];
+            cache = 1;
+        } else if(!strcmp("--cache-size", argv[arg])){
+            arg++;
+            if(arg >= argc){
+                printf("--cache-size requires one more argument.\n");
+                exit(0);
+            }
+            if(atoi(argv[arg]) <= 0){
+                printf("The cache size must be greater than 0\n");
+                exit(0);
+            }
+            globals.cacheSize = (uint64_t)atoi(argv[arg]) << 20;
         } else if (!strcmp("--cache", argv[arg]) || !strcmp("-c", argv[arg])){
             cache = 1;
         } else if (!strcmp("--help", argv[arg]) || !strcmp("-h", argv[arg])){
@@ -977,6 +1862,7 @@ int main(int argc, char **argv){
     globals.mpqShift = (size_t)shift;
     globals.blockSize = 512 * (1 << globals.mpqShift);
     globals.useCache = cache;
+    InitMemCache(&globals.memCache, memCache << 20);
     
     globals.mpq_file = fopen(outmpq_path, "wb");
     if(globals.mpq_file == NULL){
@@ -1001,20 +1887,25 @@ int main(int argc, char **argv){
     
     InitTable(&globals.mpq_table, globals.inMpq.tbl.btSize);
     
-    char **pathes = malloc(sizeof(char*)*globals.inMpq.tbl.btSize);
+    packjob_t *files = malloc(sizeof(packjob_t)*globals.inMpq.tbl.btSize);
     size_t cnt = 0;
     for(size_t i = 0; i != globals.listfile.size; i++){
         if(globals.listfile.list[i].hash != 0){
             char *path = globals.listfile.list[i].path;
             if(!strcmp("(listfile)", path) || !strcmp("(attributes)", path))
                 continue;
-            pathes[cnt++] = path;
+            InitPackJob(&files[cnt], path);
+            cnt++;
         }
     }
 
-    InitQueue(&globals.work_queue, pathes, cnt, sizeof(char*));
-    
-    globals.lock = Sys_CreateLock();
+    // longest processing time first, so no thread is left with a big file
+    // at the end of the run
+    qsort(files, cnt, sizeof(packjob_t), CompareCost);
+
+    SelectHashed(files, cnt);
+    globals.files = files;
+    globals.numFiles = cnt;
     
     CopyPreMPQData();
     mkmpq(threads);
@@ -0,0 +1,554 @@
+#define _XOPEN_SOURCE 600 // pread, pwrite, ftruncate
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "diskcache.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define INDEX_MAGIC "MPQCIDX2"
+#define PACK_MAGIC "MPQCPAK1"
+#define MIN_SLOTS 1024
+
+// every record in the pack starts with its key and size, so an index which
+// doesn't match the pack (e.g. after a crash) can't hand out wrong data
+#define RECORD_HEADER 36
+
+// byte range locks of the index, far behind its data so they never get in
+// the way of reading it. every process holds a shared lock on USERS_LOCK as
+// long as it has the cache open, only a process which gets it exclusively
+// is alone and may shrink the files. WRITER_LOCK is held exclusively while
+// the index or the pack are changed.
+#define USERS_LOCK 0x7FFFFF00u
+#define WRITER_LOCK 0x7FFFFF01u
+
+// files shared with other processes, positioned reads and writes, byte range
+// locks and shared mappings
+#ifdef _WIN32
+#define NO_FILE INVALID_HANDLE_VALUE
+
+static cachefile_t FileOpen(const char *path){
+    return CreateFile(path, GENERIC_READ | GENERIC_WRITE,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                      OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+static void FileClose(cachefile_t f){
+    CloseHandle(f);
+}
+
+static uint64_t FileSize(cachefile_t f){
+    LARGE_INTEGER s;
+    if(!GetFileSizeEx(f, &s))
+        return 0;
+    return s.QuadPart;
+}
+
+static int FileRead(cachefile_t f, void *data, size_t size, uint64_t offset){
+    OVERLAPPED ov = {0};
+    DWORD n;
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    return ReadFile(f, data, size, &n, &ov) && n == size;
+}
+
+static int FileWrite(cachefile_t f, const void *data, size_t size, uint64_t offset){
+    OVERLAPPED ov = {0};
+    DWORD n;
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    return WriteFile(f, data, size, &n, &ov) && n == size;
+}
+
+static int FileResize(cachefile_t f, uint64_t size){
+    LARGE_INTEGER s;
+    s.QuadPart = size;
+    return SetFilePointerEx(f, s, NULL, FILE_BEGIN) && SetEndOfFile(f);
+}
+
+// the file mapping grows the file to size if it is smaller
+static void* FileMap(cachefile_t f, size_t size, int writable){
+    HANDLE hMap = CreateFileMapping(f, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                    (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    void *p = hMap ? MapViewOfFile(hMap, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size) : NULL;
+    if(hMap)
+        CloseHandle(hMap);
+    return p;
+}
+
+static void FileUnmap(const void *p, size_t size){
+    UnmapViewOfFile(p);
+}
+
+static int FileLock(cachefile_t f, uint64_t offset, int exclusive, int wait){
+    OVERLAPPED ov = {0};
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    return LockFileEx(f, (exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0)
+                       | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY), 0, 1, 0, &ov);
+}
+
+static void FileUnlock(cachefile_t f, uint64_t offset){
+    OVERLAPPED ov = {0};
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    UnlockFileEx(f, 0, 1, 0, &ov);
+}
+
+// windows can't turn a shared lock into an exclusive one or back
+static int FileRelock(cachefile_t f, uint64_t offset, int exclusive, int wait){
+    FileUnlock(f, offset);
+    if(FileLock(f, offset, exclusive, wait))
+        return 1;
+    FileLock(f, offset, !exclusive, 1);
+    return 0;
+}
+#else
+#define NO_FILE -1
+
+static cachefile_t FileOpen(const char *path){
+    return open(path, O_RDWR | O_CREAT, 0644);
+}
+
+static void FileClose(cachefile_t f){
+    close(f);
+}
+
+static uint64_t FileSize(cachefile_t f){
+    struct stat st;
+    if(fstat(f, &st) == -1)
+        return 0;
+    return st.st_size;
+}
+
+static int FileRead(cachefile_t f, void *data, size_t size, uint64_t offset){
+    char *p = data;
+    while(size > 0){
+        ssize_t n = pread(f, p, size, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 0;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 1;
+}
+
+static int FileWrite(cachefile_t f, const void *data, size_t size, uint64_t offset){
+    const char *p = data;
+    while(size > 0){
+        ssize_t n = pwrite(f, p, size, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 0;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 1;
+}
+
+static int FileResize(cachefile_t f, uint64_t size){
+    return ftruncate(f, size) == 0;
+}
+
+// the file mapping grows the file to size if it is smaller
+static void* FileMap(cachefile_t f, size_t size, int writable){
+    if(writable && FileSize(f) < size && !FileResize(f, size))
+        return NULL;
+    void *p = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, f, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void FileUnmap(const void *p, size_t size){
+    munmap((void*)p, size);
+}
+
+// locking a range the process holds already converts the lock
+static int FileLock(cachefile_t f, uint64_t offset, int exclusive, int wait){
+    struct flock l;
+    memset(&l, 0, sizeof(l));
+    l.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    l.l_whence = SEEK_SET;
+    l.l_start = offset;
+    l.l_len = 1;
+    while(fcntl(f, wait ? F_SETLKW : F_SETLK, &l) == -1){
+        if(errno != EINTR || !wait)
+            return 0;
+    }
+    return 1;
+}
+
+static void FileUnlock(cachefile_t f, uint64_t offset){
+    struct flock l;
+    memset(&l, 0, sizeof(l));
+    l.l_type = F_UNLCK;
+    l.l_whence = SEEK_SET;
+    l.l_start = offset;
+    l.l_len = 1;
+    fcntl(f, F_SETLK, &l);
+}
+
+static int FileRelock(cachefile_t f, uint64_t offset, int exclusive, int wait){
+    return FileLock(f, offset, exclusive, wait);
+}
+#endif
+
+static size_t IndexSize(uint64_t numSlots){
+    return sizeof(diskcache_header_t) + numSlots*sizeof(diskcache_slot_t);
+}
+
+// maps numSlots slots of the index, growing the file if needed
+static int MapIndex(diskcache_t *c, uint64_t numSlots){
+    diskcache_header_t *header = FileMap(c->index, IndexSize(numSlots), 1);
+    if(!header)
+        return 0;
+    if(c->header)
+        FileUnmap(c->header, IndexSize(c->numSlots));
+    c->header = header;
+    c->slots = (diskcache_slot_t*)(header + 1);
+    c->numSlots = numSlots;
+    return 1;
+}
+
+// maps the whole pack as it is now. if that isn't possible, e.g. for lack of
+// address space, the records are read from the file instead.
+static void MapPack(diskcache_t *c){
+    if(c->packMap)
+        FileUnmap(c->packMap, c->packMapSize);
+    c->packMapSize = FileSize(c->pack);
+    c->packMap = FileMap(c->pack, c->packMapSize, 0);
+    if(!c->packMap)
+        c->packMapSize = 0;
+}
+
+// another process may have grown the table since we mapped it
+static int Remap(diskcache_t *c){
+    uint64_t numSlots = c->header->numSlots;
+    if(numSlots == c->numSlots)
+        return 1;
+    return MapIndex(c, numSlots);
+}
+
+static uint64_t Generation(diskcache_t *c){
+    return Sys_AtomicLoad64(&c->header->generation);
+}
+
+// a writer makes the generation odd before it moves anything readers might
+// be looking at and even again when it is done
+static void BumpGeneration(diskcache_t *c){
+    uint64_t generation = c->header->generation;
+    Sys_AtomicCAS64(&c->header->generation, generation, generation + 1);
+}
+
+// the slot of key or the empty slot it would go to. the table is kept at
+// most half full so there always is one, unless a writer is just moving the
+// slots around in which case NULL may be returned.
+static diskcache_slot_t* Find(diskcache_t *c, const unsigned char key[32]){
+    uint64_t mask = c->numSlots - 1;
+    uint64_t h;
+    memcpy(&h, key, sizeof(h));
+    for(uint64_t i = h & mask, n = 0; n != c->numSlots; i = (i+1) & mask, n++){
+        diskcache_slot_t *s = &c->slots[i];
+        if(!Sys_AtomicLoad64(&s->offset) || !memcmp(s->key, key, 32))
+            return s;
+    }
+    return NULL;
+}
+
+// starts over with an empty cache
+static int Reset(diskcache_t *c){
+    diskcache_header_t h;
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.numSlots = MIN_SLOTS;
+    h.numEntries = 0;
+    h.packSize = 8;
+    h.generation = 0;
+    return FileResize(c->index, 0)
+        && FileResize(c->index, IndexSize(MIN_SLOTS))
+        && FileWrite(c->index, &h, sizeof(h), 0)
+        && FileResize(c->pack, 0)
+        && FileWrite(c->pack, PACK_MAGIC, 8, 0);
+}
+
+static void Close(diskcache_t *c){
+    if(c->packMap)
+        FileUnmap(c->packMap, c->packMapSize);
+    if(c->header)
+        FileUnmap(c->header, IndexSize(c->numSlots));
+    FileClose(c->index);
+    FileClose(c->pack);
+}
+
+// Opens the cache in dir, which must exist. Returns 0 if that is not possible.
+int OpenDiskCache(diskcache_t *c, const char *dir, uint64_t maxSize){
+    char path[1024];
+    diskcache_header_t h;
+
+    memset(c, 0, sizeof(diskcache_t));
+    snprintf(path, sizeof(path), "%s/cache.idx", dir);
+    c->index = FileOpen(path);
+    if(c->index == NO_FILE)
+        return 0;
+    snprintf(path, sizeof(path), "%s/cache.pack", dir);
+    c->pack = FileOpen(path);
+    if(c->pack == NO_FILE){
+        FileClose(c->index);
+        return 0;
+    }
+
+    // only a process which is alone may reset the cache or cut off what an
+    // interrupted run appended without indexing it
+    int alone = FileLock(c->index, USERS_LOCK, 1, 0);
+    if(!alone && !FileLock(c->index, USERS_LOCK, 0, 1)){
+        Close(c);
+        return 0;
+    }
+    FileLock(c->index, WRITER_LOCK, 1, 1);
+
+    uint64_t indexSize = FileSize(c->index);
+    int valid = indexSize >= sizeof(h)
+             && FileRead(c->index, &h, sizeof(h), 0)
+             && !memcmp(h.magic, INDEX_MAGIC, 8)
+             && h.numSlots >= MIN_SLOTS
+             && (h.numSlots & (h.numSlots-1)) == 0
+             && h.numEntries*2 <= h.numSlots
+             && indexSize == IndexSize(h.numSlots)
+             && FileSize(c->pack) >= h.packSize;
+    int ok = 1;
+    if(valid){
+        if(alone)
+            FileResize(c->pack, h.packSize);
+    }else{
+        ok = alone && Reset(c);
+        h.numSlots = MIN_SLOTS;
+    }
+    ok = ok && MapIndex(c, h.numSlots);
+
+    FileUnlock(c->index, WRITER_LOCK);
+    if(!ok){
+        Close(c);
+        return 0;
+    }
+    if(alone)
+        FileRelock(c->index, USERS_LOCK, 0, 1);
+
+    MapPack(c);
+    c->maxSize = maxSize;
+    c->lock = Sys_CreateLock();
+    return 1;
+}
+
+// Returns a copy of the data stored under key which the caller frees, or NULL
+// if there is none. Readers don't lock the files, records are only appended
+// and a slot gets its offset last. whatever a reader finds while the
+// generation changes is thrown away.
+unsigned char* LookupDiskCache(diskcache_t *c, const unsigned char key[32], size_t *size){
+    unsigned char *data = NULL;
+    uint32_t dataSize = 0;
+
+    Sys_Lock(c->lock);
+    uint64_t generation = Generation(c);
+    diskcache_slot_t *s = generation & 1 || !Remap(c) ? NULL : Find(c, key);
+    uint64_t offset = s ? Sys_AtomicLoad64(&s->offset) : 0;
+    if(offset){
+        uint32_t recordSize;
+        dataSize = s->size;
+        uint64_t end = offset + RECORD_HEADER + dataSize;
+        if(end > c->packMapSize)
+            MapPack(c);
+
+        unsigned char *record = NULL;
+        const unsigned char *p = NULL;
+        if(end <= c->packMapSize){
+            p = c->packMap + offset;
+        }else if(!c->packMap && end <= FileSize(c->pack)){
+            record = malloc(RECORD_HEADER + dataSize);
+            if(FileRead(c->pack, record, RECORD_HEADER + dataSize, offset))
+                p = record;
+        }
+        if(p && !memcmp(p, key, 32)
+        && (memcpy(&recordSize, p + 32, 4), recordSize == dataSize)){
+            data = malloc(dataSize ? dataSize : 1);
+            memcpy(data, p + RECORD_HEADER, dataSize);
+        }
+        free(record);
+    }
+    if(data && Generation(c) == generation){
+        *size = dataSize;
+        s->lastUse = (uint32_t)time(NULL);
+    }else{
+        free(data);
+        data = NULL;
+    }
+    Sys_Unlock(c->lock);
+    return data;
+}
+
+// doubles the hash table, must be called with the writer lock held
+static void Grow(diskcache_t *c){
+    diskcache_header_t h = *c->header;
+    diskcache_slot_t *old = malloc(h.numSlots*sizeof(diskcache_slot_t));
+    memcpy(old, c->slots, h.numSlots*sizeof(diskcache_slot_t));
+
+    BumpGeneration(c);
+    if(!MapIndex(c, 2*h.numSlots)){
+        perror("Failed to grow the cache index");
+        exit(1);
+    }
+    memset(c->slots, 0, c->numSlots*sizeof(diskcache_slot_t));
+    for(uint64_t i = 0; i != h.numSlots; i++){
+        if(old[i].offset)
+            *Find(c, old[i].key) = old[i];
+    }
+    c->header->numSlots = c->numSlots;
+    BumpGeneration(c);
+    free(old);
+}
+
+// Stores data under key. Data which was stored under it before is overwritten
+// if the new data fits into its record, otherwise it stays in the pack until
+// the next eviction compacts it away. Overwriting clears the key of the record
+// first, so it is never found half written.
+void InsertDiskCache(diskcache_t *c, const unsigned char key[32], const unsigned char *data, size_t size){
+    unsigned char head[RECORD_HEADER];
+    uint32_t size32 = (uint32_t)size;
+    if(size != size32)
+        return;
+
+    Sys_Lock(c->lock);
+    FileLock(c->index, WRITER_LOCK, 1, 1);
+    diskcache_slot_t *s = Remap(c) ? Find(c, key) : NULL;
+    if(!s){
+        perror("Failed to update the cache");
+        goto done;
+    }
+    int replaced = s->offset != 0;
+
+    memset(head, 0, RECORD_HEADER);
+    if(replaced && size32 <= s->size){
+        uint64_t offset = s->offset;
+        BumpGeneration(c);
+        int ok = FileWrite(c->pack, head, RECORD_HEADER, offset)
+              && FileWrite(c->pack, data, size, offset + RECORD_HEADER);
+        memcpy(head, key, 32);
+        memcpy(head + 32, &size32, 4);
+        ok = ok && FileWrite(c->pack, head, RECORD_HEADER, offset);
+        s->size = size32;
+        s->lastUse = (uint32_t)time(NULL);
+        BumpGeneration(c);
+        if(!ok)
+            perror("Failed to update the cache");
+        goto done;
+    }
+
+    uint64_t offset = c->header->packSize;
+    memcpy(head, key, 32);
+    memcpy(head + 32, &size32, 4);
+    if(!FileWrite(c->pack, head, RECORD_HEADER, offset)
+    || !FileWrite(c->pack, data, size, offset + RECORD_HEADER)){
+        perror("Failed to update the cache");
+        goto done;
+    }
+
+    memcpy(s->key, key, 32);
+    s->size = size32;
+    s->lastUse = (uint32_t)time(NULL);
+    Sys_AtomicStore64(&s->offset, offset);
+    c->header->packSize += RECORD_HEADER + size;
+    if(!replaced && ++c->header->numEntries*2 > c->header->numSlots)
+        Grow(c);
+done:
+    FileUnlock(c->index, WRITER_LOCK);
+    Sys_Unlock(c->lock);
+}
+
+static int CompareLastUse(const void *a, const void *b){
+    uint32_t ua = ((const diskcache_slot_t*)a)->lastUse,
+             ub = ((const diskcache_slot_t*)b)->lastUse;
+    return ua < ub ? 1 : ua > ub ? -1 : 0;
+}
+
+static int CompareOffset(const void *a, const void *b){
+    uint64_t oa = ((const diskcache_slot_t*)a)->offset,
+             ob = ((const diskcache_slot_t*)b)->offset;
+    return oa < ob ? -1 : oa > ob ? 1 : 0;
+}
+
+// Drops the least recently used entries until the pack fits into maxSize. The
+// remaining records are moved to the front of the pack in the order they are
+// in, so none is overwritten before it was moved itself. That also happens if
+// a quarter of the pack are records which were replaced by bigger ones. Only
+// a process which has the cache to itself may do that.
+static void Evict(diskcache_t *c){
+    uint64_t numSlots = c->header->numSlots;
+    uint64_t liveSize = 8;
+    for(uint64_t i = 0; i != numSlots; i++){
+        if(c->slots[i].offset)
+            liveSize += RECORD_HEADER + c->slots[i].size;
+    }
+    if(c->header->packSize <= c->maxSize && liveSize >= c->header->packSize - c->header->packSize/4)
+        return;
+
+    diskcache_slot_t *live = malloc(c->header->numEntries*sizeof(diskcache_slot_t));
+    size_t cnt = 0;
+    for(uint64_t i = 0; i != numSlots; i++){
+        if(c->slots[i].offset)
+            live[cnt++] = c->slots[i];
+    }
+    qsort(live, cnt, sizeof(diskcache_slot_t), CompareLastUse);
+
+    size_t keep = 0;
+    uint64_t total = 8;
+    while(keep != cnt && total + RECORD_HEADER + live[keep].size <= c->maxSize)
+        total += RECORD_HEADER + live[keep++].size;
+    qsort(live, keep, sizeof(diskcache_slot_t), CompareOffset);
+
+    uint64_t pos = 8;
+    for(size_t i = 0; i != keep; i++){
+        size_t recordSize = RECORD_HEADER + live[i].size;
+        if(live[i].offset != pos){
+            unsigned char *record = malloc(recordSize);
+            int ok = FileRead(c->pack, record, recordSize, live[i].offset)
+                  && FileWrite(c->pack, record, recordSize, pos);
+            free(record);
+            if(!ok){
+                perror("Failed to shrink the cache");
+                keep = i;
+                break;
+            }
+            live[i].offset = pos;
+        }
+        pos += recordSize;
+    }
+
+    memset(c->slots, 0, numSlots*sizeof(diskcache_slot_t));
+    for(size_t i = 0; i != keep; i++)
+        *Find(c, live[i].key) = live[i];
+    c->header->numEntries = keep;
+    c->header->packSize = pos;
+    FileResize(c->pack, pos);
+    free(live);
+}
+
+// The last process to close the cache trims it to maxSize, the others leave
+// that to it.
+void CloseDiskCache(diskcache_t *c){
+    if(c->packMap)
+        FileUnmap(c->packMap, c->packMapSize);
+    c->packMap = NULL;
+    if(FileRelock(c->index, USERS_LOCK, 1, 0) && Remap(c))
+        Evict(c);
+    Close(c);
+}
@@ -0,0 +1,64 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thread.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+typedef HANDLE cachefile_t;
+#else
+typedef int cachefile_t;
+#endif
+
+// a persistent cache of packed data in two files of one directory. the data
+// is appended to cache.pack, cache.idx is a memory-mapped open addressing
+// hash table from 32 byte keys to it. a lookup is a probe of the mapped
+// table and a copy out of the mapped pack. several processes can use the
+// cache at once: writers take a short file lock, readers take none and
+// check the generation instead, see LookupDiskCache. inside the process a
+// lock serializes the accesses.
+struct diskcache_header {
+    char magic[8];
+    uint64_t numSlots;
+    uint64_t numEntries;
+    uint64_t packSize;
+    // odd while a writer moves slots or records around
+    uint64_t generation;
+};
+
+typedef struct diskcache_header diskcache_header_t;
+
+struct diskcache_slot {
+    unsigned char key[32];
+    uint64_t offset; // of the record in the pack, 0 if the slot is empty
+    uint32_t size;
+    uint32_t lastUse; // unix time, the least recently used go first
+};
+
+typedef struct diskcache_slot diskcache_slot_t;
+
+struct diskcache {
+    cachefile_t pack;
+    cachefile_t index;
+    diskcache_header_t *header;
+    diskcache_slot_t *slots;
+    uint64_t numSlots; // the slots mapped, the header may have more already
+    const unsigned char *packMap;
+    uint64_t packMapSize;
+    uint64_t maxSize;
+    sys_lock_t lock;
+};
+
+typedef struct diskcache diskcache_t;
+
+int OpenDiskCache(diskcache_t *c, const char *dir, uint64_t maxSize);
+void CloseDiskCache(diskcache_t *c);
+unsigned char* LookupDiskCache(diskcache_t *c, const unsigned char key[32], size_t *size);
+void InsertDiskCache(diskcache_t *c, const unsigned char key[32], const unsigned char *data, size_t size);
+
+#endif
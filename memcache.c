@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include "memcache.h"
+
+// the average entry the slots are sized for, bigger entries just leave
+// some slots empty
+#define MEMCACHE_ENTRY_SIZE (16*1024)
+
+// the keys are hashes already so any of their bytes pick a set evenly
+static memcache_entry_t * volatile *Set(memcache_t *c, const unsigned char key[32]){
+    size_t h;
+    memcpy(&h, key, sizeof(h));
+    return &c->slots[(h & (c->numSets-1)) * MEMCACHE_WAYS];
+}
+
+void InitMemCache(memcache_t *c, size_t capacity){
+    size_t sets = 1;
+    while(sets*MEMCACHE_WAYS*MEMCACHE_ENTRY_SIZE < capacity)
+        sets <<= 1;
+
+    c->numSets = sets;
+    c->slots = calloc(sets*MEMCACHE_WAYS, sizeof(memcache_entry_t*));
+    c->capacity = capacity;
+    c->used = 0;
+    c->tick = 0;
+    c->readers = 0;
+    c->retired = NULL;
+    c->lock = Sys_CreateLock();
+}
+
+static void FreeRetired(memcache_t *c){
+    while(c->retired){
+        memcache_entry_t *e = c->retired;
+        c->retired = e->nextRetired;
+        free(e);
+    }
+}
+
+void FreeMemCache(memcache_t *c){
+    for(size_t i = 0; i != c->numSets*MEMCACHE_WAYS; i++)
+        free(c->slots[i]);
+    FreeRetired(c);
+    free((void*)c->slots);
+    c->slots = NULL;
+    c->capacity = 0;
+}
+
+// returns a copy of the data stored under key which the caller frees, or
+// NULL if there is none
+unsigned char* LookupMemCache(memcache_t *c, const unsigned char key[32], size_t *size){
+    unsigned char *out = NULL;
+    if(!c->capacity)
+        return NULL;
+
+    // an entry evicted after we announced ourselves stays allocated until
+    // we are done, see Evict
+    Sys_AtomicAdd(&c->readers, 1);
+    memcache_entry_t * volatile *set = Set(c, key);
+    for(int i = 0; i != MEMCACHE_WAYS; i++){
+        memcache_entry_t *e = Sys_AtomicLoadPtr((void * volatile*)&set[i]);
+        if(e && !memcmp(e->key, key, 32)){
+            e->lastUse = Sys_AtomicAdd(&c->tick, 1);
+            out = malloc(e->size);
+            memcpy(out, e->data, e->size);
+            *size = e->size;
+            break;
+        }
+    }
+    // the last reader out frees what was evicted while lookups were running,
+    // an insert only gets to it if it finds no lookup running
+    if(Sys_AtomicAdd(&c->readers, (size_t)-1) == 0
+    && Sys_AtomicLoadPtr((void * volatile*)&c->retired)){
+        Sys_Lock(c->lock);
+        if(Sys_AtomicAdd(&c->readers, 0) == 0)
+            FreeRetired(c);
+        Sys_Unlock(c->lock);
+    }
+    return out;
+}
+
+// must be called with the lock held
+static void Evict(memcache_t *c, memcache_entry_t * volatile *slot){
+    memcache_entry_t *e = *slot;
+    Sys_AtomicStorePtr((void * volatile*)slot, NULL);
+    c->used -= e->size;
+    e->nextRetired = c->retired;
+    Sys_AtomicStorePtr((void * volatile*)&c->retired, e);
+}
+
+// must be called with the lock held
+static memcache_entry_t * volatile *LeastRecentlyUsed(memcache_entry_t * volatile *slots, size_t n){
+    memcache_entry_t * volatile *lru = NULL;
+    for(size_t i = 0; i != n; i++){
+        if(slots[i] && (!lru || slots[i]->lastUse < (*lru)->lastUse))
+            lru = &slots[i];
+    }
+    return lru;
+}
+
+void InsertMemCache(memcache_t *c, const unsigned char key[32], const unsigned char *data, size_t size){
+    if(size > c->capacity)
+        return;
+
+    memcache_entry_t *e = malloc(sizeof(memcache_entry_t) + size);
+    memcpy(e->key, key, 32);
+    memcpy(e->data, data, size);
+    e->size = size;
+    e->lastUse = Sys_AtomicAdd(&c->tick, 1);
+
+    Sys_Lock(c->lock);
+    memcache_entry_t * volatile *set = Set(c, key);
+    memcache_entry_t * volatile *slot = NULL;
+    for(int i = 0; i != MEMCACHE_WAYS; i++){
+        if(set[i] && !memcmp(set[i]->key, key, 32)){
+            // someone else packed the same data meanwhile
+            Sys_Unlock(c->lock);
+            free(e);
+            return;
+        }
+        if(!set[i] && !slot)
+            slot = &set[i];
+    }
+    if(!slot){
+        slot = LeastRecentlyUsed(set, MEMCACHE_WAYS);
+        Evict(c, slot);
+    }
+    while(c->used + size > c->capacity)
+        Evict(c, LeastRecentlyUsed(c->slots, c->numSets*MEMCACHE_WAYS));
+
+    c->used += size;
+    Sys_AtomicStorePtr((void * volatile*)slot, e);
+
+    // the stores above made the evicted entries unreachable, so no lookup
+    // starting now can find them
+    if(Sys_AtomicAdd(&c->readers, 0) == 0)
+        FreeRetired(c);
+    Sys_Unlock(c->lock);
+}
@@ -0,0 +1,40 @@
+#ifndef MEMCACHE_H
+#define MEMCACHE_H
+
+#include "thread.h"
+
+// an in-memory LRU cache of packed data keyed by a 32 byte digest. every key
+// maps to a set of MEMCACHE_WAYS slots. lookups only read the slots of one
+// set and never take the lock, inserts and evictions are serialized by it.
+#define MEMCACHE_WAYS 4
+
+struct memcache_entry {
+    unsigned char key[32];
+    volatile size_t lastUse;
+    size_t size;
+    // evicted entries are freed once no lookup can still be reading them
+    struct memcache_entry *nextRetired;
+    unsigned char data[];
+};
+
+typedef struct memcache_entry memcache_entry_t;
+
+struct memcache {
+    memcache_entry_t * volatile *slots;
+    size_t numSets;
+    size_t capacity; // in bytes, 0 if the cache is disabled
+    size_t used;
+    volatile size_t tick;
+    volatile size_t readers;
+    memcache_entry_t *retired;
+    sys_lock_t lock;
+};
+
+typedef struct memcache memcache_t;
+
+void InitMemCache(memcache_t *c, size_t capacity);
+void FreeMemCache(memcache_t *c);
+unsigned char* LookupMemCache(memcache_t *c, const unsigned char key[32], size_t *size);
+void InsertMemCache(memcache_t *c, const unsigned char key[32], const unsigned char *data, size_t size);
+
+#endif
@@ -1,25 +1,153 @@
+#include <stdlib.h>
 #include "queue.h"
 
+// the deque is a ring buffer indexed by 24 bit counters. the owner takes
+// work from the head, thieves take it from the tail and the owner pushes to
+// the tail. the stamp changes on every push so a thief which read a slot
+// before it was refilled can't succeed with its compare-and-swap.
+#define DEQUE_BITS 24
+#define DEQUE_MASK ((1u << DEQUE_BITS) - 1)
+#define DEQUE_MAX_CAPACITY (1u << (DEQUE_BITS - 1))
+
+static uint64_t Pack(uint32_t head, uint32_t tail, uint32_t stamp){
+    return  (uint64_t)(head & DEQUE_MASK)
+         | ((uint64_t)(tail & DEQUE_MASK) << DEQUE_BITS)
+         | ((uint64_t)(stamp & 0xFFFF) << (2*DEQUE_BITS));
+}
+
+static uint32_t Head(uint64_t range){ return range & DEQUE_MASK; }
+static uint32_t Tail(uint64_t range){ return (range >> DEQUE_BITS) & DEQUE_MASK; }
+static uint32_t Stamp(uint64_t range){ return range >> (2*DEQUE_BITS); }
+static uint32_t Count(uint64_t range){ return (Tail(range) - Head(range)) & DEQUE_MASK; }
+
+// the capacity is a power of two so the slots stay in order when the
+// counters wrap around
+static void InitDeque(deque_t *d, size_t capacity){
+    size_t c = 1;
+    while(c < capacity && c < DEQUE_MAX_CAPACITY)
+        c <<= 1;
+    capacity = c;
+    d->range = Pack(0, 0, 0);
+    d->capacity = capacity;
+    d->items = malloc(capacity*sizeof(void*));
+}
+
+static void *PopHead(deque_t *d){
+    for(;;){
+        uint64_t r = Sys_AtomicLoad64(&d->range);
+        if(Count(r) == 0)
+            return NULL;
+        void *item = d->items[Head(r) % d->capacity];
+        if(Sys_AtomicCAS64(&d->range, r, Pack(Head(r)+1, Tail(r), Stamp(r))))
+            return item;
+    }
+}
+
+static void *StealTail(deque_t *d){
+    for(;;){
+        uint64_t r = Sys_AtomicLoad64(&d->range);
+        if(Count(r) == 0)
+            return NULL;
+        void *item = d->items[(Tail(r)-1) % d->capacity];
+        if(Sys_AtomicCAS64(&d->range, r, Pack(Head(r), Tail(r)-1, Stamp(r))))
+            return item;
+    }
+}
+
+// must only be called by the owner of the deque
+static int PushTail(deque_t *d, void *item){
+    for(;;){
+        uint64_t r = Sys_AtomicLoad64(&d->range);
+        if(Count(r) >= d->capacity)
+            return 0;
+        d->items[Tail(r) % d->capacity] = item;
+        if(Sys_AtomicCAS64(&d->range, r, Pack(Head(r), Tail(r)+1, Stamp(r)+1)))
+            return 1;
+    }
+}
+
 void InitQueue(queue_t *q, void *elems, size_t size, size_t elemSize){
+    InitWorkQueue(q, elems, size, elemSize, 1, size);
+}
+
+// the elements are dealt out round-robin so every worker starts with the
+// front of the (sorted) element list. capacity is the amount of elements
+// every deque can hold in addition to the initial ones. a deque holds at most
+// DEQUE_MAX_CAPACITY items, the elements from the first one which doesn't
+// fit on are left to the overflow.
+void InitWorkQueue(queue_t *q, void *elems, size_t size, size_t elemSize, size_t numWorkers, size_t capacity){
     q->cur = 0;
     q->size = size;
     q->elemSize = elemSize;
     q->elements = elems;
-    q->lock = Sys_CreateLock();
+    q->numDeques = numWorkers ? numWorkers : 1;
+    q->deques = malloc(q->numDeques*sizeof(deque_t));
+
+    for(size_t i = 0; i != q->numDeques; i++){
+        size_t share = size/q->numDeques + (i < size%q->numDeques);
+        InitDeque(&q->deques[i], share + capacity);
+    }
+    size_t seeded = 0;
+    for(; seeded != size; seeded++){
+        deque_t *d = &q->deques[seeded % q->numDeques];
+        size_t slot = seeded / q->numDeques;
+        if(slot >= d->capacity)
+            break;
+        d->items[slot] = (char*)elems + elemSize*seeded;
+    }
+    for(size_t i = 0; i != q->numDeques; i++){
+        size_t share = seeded/q->numDeques + (i < seeded%q->numDeques);
+        q->deques[i].range = Pack(0, share, 0);
+    }
+    q->overflow = seeded;
+    q->overflowEnd = size;
 }
 
 void *pop(queue_t *q, size_t *status){
-    Sys_Lock(q->lock);
-    
-    void *r;
-    if(q->cur >= q->size)
-        r = NULL;
-    else
-        r = q->elements + q->elemSize*q->cur++;
-        
+    size_t self = Sys_ThreadIndex() % q->numDeques;
+    void *r = PopHead(&q->deques[self]);
+
+    for(size_t i = 1; r == NULL && i < q->numDeques; i++){
+        r = StealTail(&q->deques[(self+i) % q->numDeques]);
+    }
+    if(r == NULL && q->overflow < q->overflowEnd){
+        size_t i = Sys_AtomicAdd(&q->overflow, 1) - 1;
+        if(i < q->overflowEnd)
+            r = (char*)q->elements + q->elemSize*i;
+    }
+
+    size_t cur = r ? Sys_AtomicAdd(&q->cur, 1) : q->cur;
     if(status)
-        *status = q->cur;
-        
-    Sys_Unlock(q->lock);
+        *status = cur;
+
     return r;
 }
+
+// queues more work for the calling worker. returns 0 if the deque is full
+// (or the caller doesn't own one) in which case the caller should just do
+// the work itself.
+int push(queue_t *q, void *elem){
+    size_t self = Sys_ThreadIndex();
+    if(self >= q->numDeques)
+        return 0;
+    if(!PushTail(&q->deques[self], elem))
+        return 0;
+    Sys_AtomicAdd(&q->size, 1);
+    return 1;
+}
+
+// takes elem back if it is still the last item the calling worker pushed.
+// returns 0 if a thief took it already.
+int unpush(queue_t *q, void *elem){
+    size_t self = Sys_ThreadIndex();
+    if(self >= q->numDeques)
+        return 0;
+    deque_t *d = &q->deques[self];
+    for(;;){
+        uint64_t r = Sys_AtomicLoad64(&d->range);
+        if(Count(r) == 0 || d->items[(Tail(r)-1) % d->capacity] != elem)
+            return 0;
+        if(Sys_AtomicCAS64(&d->range, r, Pack(Head(r), Tail(r)-1, Stamp(r))))
+            return 1;
+    }
+}
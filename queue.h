@@ -3,18 +3,37 @@
 
 #include "thread.h"
 
+// a bounded work-stealing deque. head, tail and a push stamp are packed into
+// a single word so every operation is one compare-and-swap.
+struct deque {
+    volatile uint64_t range;
+    size_t capacity;
+    void **items;
+};
+
+typedef struct deque deque_t;
+
 struct queue {
     size_t size;
-    size_t cur;
+    volatile size_t cur;
     size_t elemSize;
     void *elements;
-    sys_lock_t lock;
+
+    size_t numDeques;
+    deque_t *deques;
+    // the elements which didn't fit into the deques, handed out in order
+    // once the deques ran dry
+    volatile size_t overflow;
+    size_t overflowEnd;
 };
 
 typedef struct queue queue_t;
 
 void InitQueue(queue_t *q, void *elems, size_t size, size_t elemSize);
+void InitWorkQueue(queue_t *q, void *elems, size_t size, size_t elemSize, size_t numWorkers, size_t capacity);
 void *pop(queue_t *q, size_t *status);
+int push(queue_t *q, void *elem);
+int unpush(queue_t *q, void *elem);
 
 
 #endif
@@ -1,9 +1,31 @@
 #include <stdlib.h>
 #include "thread.h"
 
+struct thread_start {
+    sys_thread_action_t action;
+    void *arg;
+    size_t index;
+};
+
+// the main thread is 0, every created thread gets the next free index
+static __thread size_t threadIndex = 0;
+static volatile size_t nextThreadIndex = 1;
+
+static void* ThreadStart(void *arg){
+    struct thread_start start = *(struct thread_start*)arg;
+    free(arg);
+    threadIndex = start.index;
+    start.action(start.arg);
+    return NULL;
+}
+
 sys_thread_t Sys_CreateThread( sys_thread_action_t action, void* arg ){
     pthread_t *t = malloc(sizeof(pthread_t));
-    pthread_create(t, NULL, (void*(*)(void*))action, arg);
+    struct thread_start *start = malloc(sizeof(struct thread_start));
+    start->action = action;
+    start->arg = arg;
+    start->index = Sys_AtomicAdd(&nextThreadIndex, 1) - 1;
+    pthread_create(t, NULL, ThreadStart, start);
     return t;
     
 }
@@ -12,6 +34,10 @@ void Sys_JoinThread( sys_thread_t thread ){
     pthread_join(*thread, NULL);
 }
 
+size_t Sys_ThreadIndex(){
+    return threadIndex;
+}
+
 sys_lock_t Sys_CreateLock(){
     pthread_mutex_t *lock = malloc(sizeof(pthread_mutex_t));
     pthread_mutex_init(lock, NULL);
@@ -26,3 +52,43 @@ void Sys_Unlock( sys_lock_t lock ){
     pthread_mutex_unlock(lock);
 }
 
+sys_cond_t Sys_CreateCond(){
+    pthread_cond_t *cond = malloc(sizeof(pthread_cond_t));
+    pthread_cond_init(cond, NULL);
+    return cond;
+}
+
+// the lock must be held, it is released while waiting
+void Sys_Wait( sys_cond_t cond, sys_lock_t lock ){
+    pthread_cond_wait(cond, lock);
+}
+
+void Sys_Broadcast( sys_cond_t cond ){
+    pthread_cond_broadcast(cond);
+}
+
+// returns the new value
+size_t Sys_AtomicAdd( volatile size_t *value, size_t n ){
+    return __atomic_add_fetch(value, n, __ATOMIC_SEQ_CST);
+}
+
+uint64_t Sys_AtomicLoad64( volatile uint64_t *value ){
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+int Sys_AtomicCAS64( volatile uint64_t *value, uint64_t expected, uint64_t desired ){
+    return __atomic_compare_exchange_n(value, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void Sys_AtomicStore64( volatile uint64_t *value, uint64_t n ){
+    __atomic_store_n(value, n, __ATOMIC_RELEASE);
+}
+
+void* Sys_AtomicLoadPtr( void * volatile *value ){
+    return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+}
+
+void Sys_AtomicStorePtr( void * volatile *value, void *p ){
+    __atomic_store_n(value, p, __ATOMIC_SEQ_CST);
+}
+
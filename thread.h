@@ -2,17 +2,32 @@
 #define THREAD_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
 typedef pthread_t* sys_thread_t;
 typedef pthread_mutex_t* sys_lock_t;
+typedef pthread_cond_t* sys_cond_t;
 
 
 typedef void (*sys_thread_action_t)(void*);
 
 sys_thread_t Sys_CreateThread(sys_thread_action_t, void*);
 void         Sys_JoinThread(sys_thread_t);
+size_t       Sys_ThreadIndex();
 
 sys_lock_t   Sys_CreateLock();
 void         Sys_Lock(sys_lock_t);
 void         Sys_Unlock(sys_lock_t);
 
+sys_cond_t   Sys_CreateCond();
+void         Sys_Wait(sys_cond_t, sys_lock_t);
+void         Sys_Broadcast(sys_cond_t);
+
+size_t       Sys_AtomicAdd(volatile size_t*, size_t);
+uint64_t     Sys_AtomicLoad64(volatile uint64_t*);
+int          Sys_AtomicCAS64(volatile uint64_t*, uint64_t, uint64_t);
+void         Sys_AtomicStore64(volatile uint64_t*, uint64_t);
+void*        Sys_AtomicLoadPtr(void * volatile*);
+void         Sys_AtomicStorePtr(void * volatile*, void*);
+
 #endif
@@ -212,25 +212,64 @@ static int FindLargestSplittableBlock(
   return found;
 }
 
+/*
+Keeps the candidate split points which are in range, ascending and make the
+two blocks around them cheaper than one, looking at them from left to right.
+*/
+static void DropUnprofitablePoints(const ZopfliLZ77Store* lz77,
+                                   size_t maxblocks,
+                                   size_t* splitpoints, size_t* npoints) {
+  size_t i, j;
+  size_t n = 0;
+  for (i = 0; i < *npoints; i++) {
+    size_t start = n == 0 ? 0 : splitpoints[n - 1];
+    size_t point = splitpoints[i];
+    size_t end;
+    if (maxblocks > 0 && n + 1 >= maxblocks) break;
+    if (point <= start || point + 1 >= lz77->size) continue;
+    for (j = i + 1; j < *npoints && splitpoints[j] <= point; j++);
+    end = j == *npoints ? lz77->size : splitpoints[j];
+    if (EstimateCost(lz77, start, point) + EstimateCost(lz77, point, end) >=
+        EstimateCost(lz77, start, end)) {
+      continue;
+    }
+    splitpoints[n++] = point;
+  }
+  *npoints = n;
+}
+
 void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
                           const ZopfliLZ77Store* lz77, size_t maxblocks,
                           size_t** splitpoints, size_t* npoints) {
   size_t lstart, lend;
   size_t i;
   size_t llpos = 0;
-  size_t numblocks = 1;
+  size_t numblocks;
   unsigned char* done;
   double splitcost, origcost;
+  int found;
 
-  if (lz77->size < 10) return;  /* This code fails on tiny files. */
+  if (lz77->size < 10) {  /* This code fails on tiny files. */
+    *npoints = 0;
+    return;
+  }
 
   done = (unsigned char*)malloc(lz77->size);
   if (!done) exit(-1); /* Allocation failed. */
   for (i = 0; i < lz77->size; i++) done[i] = 0;
 
-  lstart = 0;
-  lend = lz77->size;
-  for (;;) {
+  if (*npoints == 0) {
+    lstart = 0;
+    lend = lz77->size;
+    found = 1;
+  } else {
+    DropUnprofitablePoints(lz77, maxblocks, *splitpoints, npoints);
+    found = FindLargestSplittableBlock(
+        lz77->size, done, *splitpoints, *npoints, &lstart, &lend) &&
+        lend - lstart >= 10;
+  }
+  numblocks = *npoints + 1;
+  while (found) {
     SplitCostContext c;
 
     if (maxblocks > 0 && numblocks >= maxblocks) {
@@ -255,14 +294,10 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
       numblocks++;
     }
 
-    if (!FindLargestSplittableBlock(
-        lz77->size, done, *splitpoints, *npoints, &lstart, &lend)) {
-      break;  /* No further split will probably reduce compression. */
-    }
-
-    if (lend - lstart < 10) {
-      break;
-    }
+    /* Otherwise no further split will probably reduce compression. */
+    found = FindLargestSplittableBlock(
+        lz77->size, done, *splitpoints, *npoints, &lstart, &lend) &&
+        lend - lstart >= 10;
   }
 
   if (options->verbose) {
@@ -285,13 +320,22 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
   ZopfliInitLZ77Store(in, &store);
   ZopfliInitBlockState(options, instart, inend, 0, &s);
 
-  *npoints = 0;
-  *splitpoints = 0;
-
   /* Unintuitively, Using a simple LZ77 method here instead of ZopfliLZ77Optimal
   results in better blocks. */
   ZopfliLZ77Greedy(&s, in, instart, inend, &store);
 
+  /* The candidates move to the first symbol starting at or after them. */
+  pos = instart;
+  for (i = 0; i < store.size && nlz77points < *npoints; i++) {
+    while (nlz77points < *npoints && (*splitpoints)[nlz77points] <= pos) {
+      ZOPFLI_APPEND_DATA(i, &lz77splitpoints, &nlz77points);
+    }
+    pos += store.dists[i] == 0 ? 1 : store.litlens[i];
+  }
+  free(*splitpoints);
+  *npoints = 0;
+  *splitpoints = 0;
+
   ZopfliBlockSplitLZ77(options,
                        &store, maxblocks,
                        &lz77splitpoints, &nlz77points);
@@ -38,6 +38,9 @@ ones that enhance it.
 Does blocksplitting on LZ77 data.
 The output splitpoints are indices in the LZ77 data.
 maxblocks: set a limit to the amount of blocks. Set to 0 to mean no limit.
+Split points which are in splitpoints already, ascending, are candidates: those
+which don't make the blocks around them cheaper are dropped and the blocks
+between the others are split further.
 */
 void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
                           const ZopfliLZ77Store* lz77, size_t maxblocks,
@@ -53,7 +56,9 @@ instart: where to start splitting
 inend: where to end splitting (not inclusive)
 maxblocks: maximum amount of blocks to split into, or 0 for no limit
 splitpoints: dynamic array to put the resulting split point coordinates into.
-  The coordinates are indices in the input array.
+  The coordinates are indices in the input array. If it holds split points
+  already, ascending, they are refined like in ZopfliBlockSplitLZ77 instead of
+  starting over, e.g. those of an earlier run on similar data.
 npoints: pointer to amount of splitpoints, for the dynamic array. The amount of
   blocks is the amount of splitpoitns + 1.
 */
@@ -45,6 +45,12 @@ typedef struct ZopfliLongestMatchCache {
 /* Initializes the ZopfliLongestMatchCache. */
 void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc);
 
+/* Allocates the ZopfliLongestMatchCache without initializing it. */
+void ZopfliAllocCache(size_t blocksize, ZopfliLongestMatchCache* lmc);
+
+/* Marks the first blocksize values of an allocated cache as not filled in. */
+void ZopfliResetCache(size_t blocksize, ZopfliLongestMatchCache* lmc);
+
 /* Frees up the memory of the ZopfliLongestMatchCache. */
 void ZopfliCleanCache(ZopfliLongestMatchCache* lmc);
 
@@ -723,6 +723,95 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
   ZopfliCleanLZ77Store(&fixedstore);
 }
 
+/*
+The pieces of the block split segments of ZopfliDeflatePart, squeezed
+independently. Every segment is one piece unless it is longer than
+ZopfliOptions.squeezewindow.
+*/
+typedef struct SegmentTasks {
+  const ZopfliOptions* options;
+  const unsigned char* in;
+  /* Piece i is [starts[i], starts[i + 1]) in byte coordinates. */
+  size_t* starts;
+  size_t npieces;
+  ZopfliLZ77Store* stores;  /* Receives the LZ77 data of each piece. */
+  /* Receives the ZOPFLI_WARM_FREQS frequencies of each piece, or NULL. */
+  unsigned* freqs;
+} SegmentTasks;
+
+/*
+The frequencies of the warm start block which the segment [start, end) has
+the most in common with, the one holding its middle. NULL if there is none.
+*/
+static const unsigned* WarmFreqs(const ZopfliWarmStart* warm,
+                                 size_t start, size_t end) {
+  size_t middle = start + (end - start) / 2;
+  size_t i;
+  if (!warm || warm->nblocks == 0) return 0;
+  for (i = 1; i < warm->nblocks && warm->blockstarts[i] <= middle; i++);
+  return &warm->freqs[(i - 1) * ZOPFLI_WARM_FREQS];
+}
+
+/*
+The block starts of the warm start inside (instart, inend) as split points,
+at most maxblocks - 1 of them unless maxblocks is 0.
+*/
+static void WarmSplitPoints(const ZopfliWarmStart* warm,
+                            size_t instart, size_t inend, size_t maxblocks,
+                            size_t** splitpoints, size_t* npoints) {
+  size_t i;
+  for (i = 0; i < warm->nblocks; i++) {
+    size_t start = warm->blockstarts[i];
+    if (maxblocks > 0 && *npoints + 1 >= maxblocks) break;
+    if (start <= instart || start >= inend) continue;
+    if (*npoints > 0 && start <= (*splitpoints)[*npoints - 1]) continue;
+    ZOPFLI_APPEND_DATA(start, splitpoints, npoints);
+  }
+}
+
+/* Appends a block starting at start with the given frequencies to warm. */
+static void AddWarmBlock(size_t start, const unsigned* freqs,
+                         ZopfliWarmStart* warm) {
+  size_t n = warm->nblocks;
+  warm->blockstarts =
+      (size_t*)realloc(warm->blockstarts, sizeof(size_t) * (n + 1));
+  warm->freqs = (unsigned*)realloc(warm->freqs,
+      sizeof(unsigned) * (n + 1) * ZOPFLI_WARM_FREQS);
+  if (!warm->blockstarts || !warm->freqs) exit(-1); /* Allocation failed. */
+  warm->blockstarts[n] = start;
+  memcpy(&warm->freqs[n * ZOPFLI_WARM_FREQS], freqs,
+         sizeof(unsigned) * ZOPFLI_WARM_FREQS);
+  warm->nblocks = n + 1;
+}
+
+void ZopfliInitWarmStart(ZopfliWarmStart* warm) {
+  warm->nblocks = 0;
+  warm->blockstarts = 0;
+  warm->freqs = 0;
+}
+
+void ZopfliCleanWarmStart(ZopfliWarmStart* warm) {
+  free(warm->blockstarts);
+  free(warm->freqs);
+  ZopfliInitWarmStart(warm);
+}
+
+/* Runs the optimal LZ77 on piece i. type: ZopfliTask */
+static void SqueezeSegment(void* context, size_t i, ZopfliScratch* scratch) {
+  SegmentTasks* tasks = (SegmentTasks*)context;
+  size_t start = tasks->starts[i];
+  size_t end = tasks->starts[i + 1];
+  ZopfliOptions options = *tasks->options;
+  ZopfliBlockState s;
+  options.scratch = scratch;
+  ZopfliInitBlockState(&options, start, end, 1, &s);
+  s.warmfreqs = WarmFreqs(options.warmstart, start, end);
+  if (tasks->freqs) s.bestfreqs = &tasks->freqs[i * ZOPFLI_WARM_FREQS];
+  ZopfliLZ77Optimal(&s, tasks->in, start, end, options.numiterations,
+                    &tasks->stores[i]);
+  ZopfliCleanBlockState(&s);
+}
+
 /*
 Deflate a part, to allow ZopfliDeflate() to use multiple master blocks if
 needed.
@@ -743,6 +832,8 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
   size_t* splitpoints = 0;
   double totalcost = 0;
   ZopfliLZ77Store lz77;
+  SegmentTasks tasks;
+  size_t* firstpiece;  /* Index of the first piece of each segment. */
 
   /* If btype=2 is specified, it tries all block types. If a lesser btype is
   given, then however it forces that one. Neither of the lesser types needs
@@ -767,6 +858,12 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
 
 
   if (options->blocksplitting) {
+    /* The block starts of a warm start are where the splitting starts from. */
+    if (options->warmstart) {
+      WarmSplitPoints(options->warmstart, instart, inend,
+                      options->blocksplittingmax,
+                      &splitpoints_uncompressed, &npoints);
+    }
     ZopfliBlockSplit(options, in, instart, inend,
                      options->blocksplittingmax,
                      &splitpoints_uncompressed, &npoints);
@@ -775,22 +872,84 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
 
   ZopfliInitLZ77Store(in, &lz77);
 
+  /* The segments don't depend on each other, so they can be squeezed in
+  parallel and are then put together in order. Segments longer than the
+  squeeze window are cut into pieces of about equal size, which bounds the
+  memory of the squeeze. */
+  tasks.options = options;
+  tasks.in = in;
+  tasks.starts = 0;
+  tasks.npieces = 0;
+  firstpiece = (size_t*)malloc(sizeof(*firstpiece) * (npoints + 2));
+  if (!firstpiece) exit(-1); /* Allocation failed. */
   for (i = 0; i <= npoints; i++) {
     size_t start = i == 0 ? instart : splitpoints_uncompressed[i - 1];
     size_t end = i == npoints ? inend : splitpoints_uncompressed[i];
-    ZopfliBlockState s;
-    ZopfliLZ77Store store;
-    ZopfliInitLZ77Store(in, &store);
-    ZopfliInitBlockState(options, start, end, 1, &s);
-    ZopfliLZ77Optimal(&s, in, start, end, options->numiterations, &store);
-    totalcost += ZopfliCalculateBlockSizeAutoType(&store, 0, store.size);
+    size_t window = options->squeezewindow;
+    size_t n = window > 0 ? (end - start + window - 1) / window : 1;
+    size_t j;
+    if (n == 0) n = 1;
+    firstpiece[i] = tasks.npieces;
+    for (j = 0; j < n; j++) {
+      size_t piecestart = start + (end - start) / n * j;
+      ZOPFLI_APPEND_DATA(piecestart, &tasks.starts, &tasks.npieces);
+    }
+  }
+  firstpiece[npoints + 1] = tasks.npieces;
+  {
+    /* The end of the last piece, which doesn't count as a piece itself. */
+    size_t npieces = tasks.npieces;
+    ZOPFLI_APPEND_DATA(inend, &tasks.starts, &npieces);
+  }
 
-    ZopfliAppendLZ77Store(&store, &lz77);
+  tasks.stores =
+      (ZopfliLZ77Store*)malloc(sizeof(*tasks.stores) * tasks.npieces);
+  if (!tasks.stores) exit(-1); /* Allocation failed. */
+  for (i = 0; i < tasks.npieces; i++) {
+    ZopfliInitLZ77Store(in, &tasks.stores[i]);
+  }
+  tasks.freqs = 0;
+  if (options->warmresult) {
+    tasks.freqs = (unsigned*)malloc(
+        sizeof(unsigned) * tasks.npieces * ZOPFLI_WARM_FREQS);
+    if (!tasks.freqs) exit(-1); /* Allocation failed. */
+  }
+
+  if (options->parallel && tasks.npieces > 1) {
+    options->parallel(SqueezeSegment, &tasks, tasks.npieces);
+  } else {
+    for (i = 0; i < tasks.npieces; i++) {
+      SqueezeSegment(&tasks, i, options->scratch);
+    }
+  }
+
+  for (i = 0; i <= npoints; i++) {
+    size_t lz77start = lz77.size;
+    size_t j, k;
+    for (j = firstpiece[i]; j < firstpiece[i + 1]; j++) {
+      ZopfliAppendLZ77Store(&tasks.stores[j], &lz77);
+      ZopfliCleanLZ77Store(&tasks.stores[j]);
+    }
+    totalcost += ZopfliCalculateBlockSizeAutoType(&lz77, lz77start, lz77.size);
     if (i < npoints) splitpoints[i] = lz77.size;
 
-    ZopfliCleanBlockState(&s);
-    ZopfliCleanLZ77Store(&store);
+    if (tasks.freqs) {
+      /* The warm start is kept per segment, with the frequencies of all its
+      pieces. */
+      unsigned* freqs = &tasks.freqs[firstpiece[i] * ZOPFLI_WARM_FREQS];
+      for (j = firstpiece[i] + 1; j < firstpiece[i + 1]; j++) {
+        for (k = 0; k < ZOPFLI_WARM_FREQS; k++) {
+          freqs[k] += tasks.freqs[j * ZOPFLI_WARM_FREQS + k];
+        }
+      }
+      freqs[256] = 1;  /* End symbol. */
+      AddWarmBlock(tasks.starts[firstpiece[i]], freqs, options->warmresult);
+    }
   }
+  free(tasks.stores);
+  free(tasks.freqs);
+  free(tasks.starts);
+  free(firstpiece);
 
   /* Second block splitting attempt */
   if (options->blocksplitting && npoints > 1) {
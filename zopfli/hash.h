@@ -49,6 +49,12 @@ typedef struct ZopfliHash {
 /* Allocates and initializes all fields of ZopfliHash. */
 void ZopfliInitHash(size_t window_size, ZopfliHash* h);
 
+/* Allocates all fields of ZopfliHash without initializing them. */
+void ZopfliAllocHash(size_t window_size, ZopfliHash* h);
+
+/* Initializes an allocated ZopfliHash so it can be used for a new run. */
+void ZopfliResetHash(size_t window_size, ZopfliHash* h);
+
 /* Frees all fields of ZopfliHash. */
 void ZopfliCleanHash(ZopfliHash* h);
 
@@ -23,9 +23,18 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* Match lengths are compared with SSE2 or AVX2 if the CPU supports it. */
+#define ZOPFLI_SIMD_MATCH
+#include <immintrin.h>
+#endif
 
 void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store) {
   store->size = 0;
+  store->capacity = 0;
+  store->mem = 0;
   store->litlens = 0;
   store->dists = 0;
   store->pos = 0;
@@ -37,57 +46,78 @@ void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store) {
 }
 
 void ZopfliCleanLZ77Store(ZopfliLZ77Store* store) {
-  free(store->litlens);
-  free(store->dists);
-  free(store->pos);
-  free(store->ll_symbol);
-  free(store->d_symbol);
-  free(store->ll_counts);
-  free(store->d_counts);
+  free(store->mem);
 }
 
 static size_t CeilDiv(size_t a, size_t b) {
   return (a + b - 1) / b;
 }
 
+void ZopfliReserveLZ77Store(ZopfliLZ77Store* store, size_t capacity) {
+  ZopfliLZ77Store old = *store;
+  size_t llsize = ZOPFLI_NUM_LL * CeilDiv(capacity, ZOPFLI_NUM_LL);
+  size_t dsize = ZOPFLI_NUM_D * CeilDiv(capacity, ZOPFLI_NUM_D);
+  size_t oldllsize = ZOPFLI_NUM_LL * CeilDiv(old.size, ZOPFLI_NUM_LL);
+  size_t olddsize = ZOPFLI_NUM_D * CeilDiv(old.size, ZOPFLI_NUM_D);
+  unsigned char* mem;
+  if (capacity <= store->capacity) return;
+
+  /* The arrays with the widest elements go first so that all stay aligned. */
+  mem = (unsigned char*)malloc(
+      capacity * (sizeof(*store->pos) + 2 * sizeof(*store->litlens) +
+                  sizeof(*store->ll_symbol) + sizeof(*store->d_symbol)) +
+      (llsize + dsize) * sizeof(*store->ll_counts));
+  if (!mem) exit(-1); /* Allocation failed. */
+  store->mem = mem;
+  store->capacity = capacity;
+  store->pos = (unsigned*)mem;
+  store->ll_counts = store->pos + capacity;
+  store->d_counts = store->ll_counts + llsize;
+  store->litlens = (unsigned short*)(store->d_counts + dsize);
+  store->dists = store->litlens + capacity;
+  store->ll_symbol = store->dists + capacity;
+  store->d_symbol = (unsigned char*)(store->ll_symbol + capacity);
+
+  if (old.size) {
+    memcpy(store->pos, old.pos, old.size * sizeof(*old.pos));
+    memcpy(store->ll_counts, old.ll_counts, oldllsize * sizeof(*old.ll_counts));
+    memcpy(store->d_counts, old.d_counts, olddsize * sizeof(*old.d_counts));
+    memcpy(store->litlens, old.litlens, old.size * sizeof(*old.litlens));
+    memcpy(store->dists, old.dists, old.size * sizeof(*old.dists));
+    memcpy(store->ll_symbol, old.ll_symbol,
+           old.size * sizeof(*old.ll_symbol));
+    memcpy(store->d_symbol, old.d_symbol, old.size * sizeof(*old.d_symbol));
+  }
+  free(old.mem);
+}
+
 void ZopfliCopyLZ77Store(
     const ZopfliLZ77Store* source, ZopfliLZ77Store* dest) {
-  size_t i;
   size_t llsize = ZOPFLI_NUM_LL * CeilDiv(source->size, ZOPFLI_NUM_LL);
   size_t dsize = ZOPFLI_NUM_D * CeilDiv(source->size, ZOPFLI_NUM_D);
-  ZopfliCleanLZ77Store(dest);
-  ZopfliInitLZ77Store(source->data, dest);
-  dest->litlens =
-      (unsigned short*)malloc(sizeof(*dest->litlens) * source->size);
-  dest->dists = (unsigned short*)malloc(sizeof(*dest->dists) * source->size);
-  dest->pos = (size_t*)malloc(sizeof(*dest->pos) * source->size);
-  dest->ll_symbol =
-      (unsigned short*)malloc(sizeof(*dest->ll_symbol) * source->size);
-  dest->d_symbol =
-      (unsigned short*)malloc(sizeof(*dest->d_symbol) * source->size);
-  dest->ll_counts = (size_t*)malloc(sizeof(*dest->ll_counts) * llsize);
-  dest->d_counts = (size_t*)malloc(sizeof(*dest->d_counts) * dsize);
-
-  /* Allocation failed. */
-  if (!dest->litlens || !dest->dists) exit(-1);
-  if (!dest->pos) exit(-1);
-  if (!dest->ll_symbol || !dest->d_symbol) exit(-1);
-  if (!dest->ll_counts || !dest->d_counts) exit(-1);
+  dest->size = 0;
+  dest->data = source->data;
+  ZopfliReserveLZ77Store(dest, source->size);
+  if (!source->size) return;
 
   dest->size = source->size;
-  for (i = 0; i < source->size; i++) {
-    dest->litlens[i] = source->litlens[i];
-    dest->dists[i] = source->dists[i];
-    dest->pos[i] = source->pos[i];
-    dest->ll_symbol[i] = source->ll_symbol[i];
-    dest->d_symbol[i] = source->d_symbol[i];
-  }
-  for (i = 0; i < llsize; i++) {
-    dest->ll_counts[i] = source->ll_counts[i];
-  }
-  for (i = 0; i < dsize; i++) {
-    dest->d_counts[i] = source->d_counts[i];
-  }
+  memcpy(dest->litlens, source->litlens,
+         source->size * sizeof(*source->litlens));
+  memcpy(dest->dists, source->dists, source->size * sizeof(*source->dists));
+  memcpy(dest->pos, source->pos, source->size * sizeof(*source->pos));
+  memcpy(dest->ll_symbol, source->ll_symbol,
+         source->size * sizeof(*source->ll_symbol));
+  memcpy(dest->d_symbol, source->d_symbol,
+         source->size * sizeof(*source->d_symbol));
+  memcpy(dest->ll_counts, source->ll_counts,
+         llsize * sizeof(*source->ll_counts));
+  memcpy(dest->d_counts, source->d_counts, dsize * sizeof(*source->d_counts));
+}
+
+void ZopfliSwapLZ77Store(ZopfliLZ77Store* a, ZopfliLZ77Store* b) {
+  ZopfliLZ77Store temp = *a;
+  *a = *b;
+  *b = temp;
 }
 
 /*
@@ -96,60 +126,60 @@ context must be a ZopfliLZ77Store*.
 */
 void ZopfliStoreLitLenDist(unsigned short length, unsigned short dist,
                            size_t pos, ZopfliLZ77Store* store) {
-  size_t i;
-  /* Needed for using ZOPFLI_APPEND_DATA multiple times. */
-  size_t origsize = store->size;
-  size_t llstart = ZOPFLI_NUM_LL * (origsize / ZOPFLI_NUM_LL);
-  size_t dstart = ZOPFLI_NUM_D * (origsize / ZOPFLI_NUM_D);
+  size_t size = store->size;
+  size_t llstart = ZOPFLI_NUM_LL * (size / ZOPFLI_NUM_LL);
+  size_t dstart = ZOPFLI_NUM_D * (size / ZOPFLI_NUM_D);
+
+  /* Stores which weren't reserved for their final size grow by doubling. */
+  if (size == store->capacity) {
+    ZopfliReserveLZ77Store(store, size ? size * 2 : ZOPFLI_NUM_LL);
+  }
 
   /* Everytime the index wraps around, a new cumulative histogram is made: we're
   keeping one histogram value per LZ77 symbol rather than a full histogram for
   each to save memory. */
-  if (origsize % ZOPFLI_NUM_LL == 0) {
-    size_t llsize = origsize;
-    for (i = 0; i < ZOPFLI_NUM_LL; i++) {
-      ZOPFLI_APPEND_DATA(
-          origsize == 0 ? 0 : store->ll_counts[origsize - ZOPFLI_NUM_LL + i],
-          &store->ll_counts, &llsize);
+  if (size % ZOPFLI_NUM_LL == 0) {
+    if (size == 0) {
+      memset(store->ll_counts, 0, ZOPFLI_NUM_LL * sizeof(*store->ll_counts));
+    } else {
+      memcpy(&store->ll_counts[llstart],
+             &store->ll_counts[llstart - ZOPFLI_NUM_LL],
+             ZOPFLI_NUM_LL * sizeof(*store->ll_counts));
     }
   }
-  if (origsize % ZOPFLI_NUM_D == 0) {
-    size_t dsize = origsize;
-    for (i = 0; i < ZOPFLI_NUM_D; i++) {
-      ZOPFLI_APPEND_DATA(
-          origsize == 0 ? 0 : store->d_counts[origsize - ZOPFLI_NUM_D + i],
-          &store->d_counts, &dsize);
+  if (size % ZOPFLI_NUM_D == 0) {
+    if (size == 0) {
+      memset(store->d_counts, 0, ZOPFLI_NUM_D * sizeof(*store->d_counts));
+    } else {
+      memcpy(&store->d_counts[dstart],
+             &store->d_counts[dstart - ZOPFLI_NUM_D],
+             ZOPFLI_NUM_D * sizeof(*store->d_counts));
     }
   }
 
-  ZOPFLI_APPEND_DATA(length, &store->litlens, &store->size);
-  store->size = origsize;
-  ZOPFLI_APPEND_DATA(dist, &store->dists, &store->size);
-  store->size = origsize;
-  ZOPFLI_APPEND_DATA(pos, &store->pos, &store->size);
   assert(length < 259);
+  assert((unsigned)pos == pos);
+  store->litlens[size] = length;
+  store->dists[size] = dist;
+  store->pos[size] = (unsigned)pos;
 
   if (dist == 0) {
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(length, &store->ll_symbol, &store->size);
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(0, &store->d_symbol, &store->size);
+    store->ll_symbol[size] = length;
+    store->d_symbol[size] = 0;
     store->ll_counts[llstart + length]++;
   } else {
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(ZopfliGetLengthSymbol(length),
-                       &store->ll_symbol, &store->size);
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(ZopfliGetDistSymbol(dist),
-                       &store->d_symbol, &store->size);
+    store->ll_symbol[size] = ZopfliGetLengthSymbol(length);
+    store->d_symbol[size] = ZopfliGetDistSymbol(dist);
     store->ll_counts[llstart + ZopfliGetLengthSymbol(length)]++;
     store->d_counts[dstart + ZopfliGetDistSymbol(dist)]++;
   }
+  store->size = size + 1;
 }
 
 void ZopfliAppendLZ77Store(const ZopfliLZ77Store* store,
                            ZopfliLZ77Store* target) {
   size_t i;
+  ZopfliReserveLZ77Store(target, target->size + store->size);
   for (i = 0; i < store->size; i++) {
     ZopfliStoreLitLenDist(store->litlens[i], store->dists[i],
                           store->pos[i], target);
@@ -218,11 +248,25 @@ void ZopfliLZ77GetHistogram(const ZopfliLZ77Store* lz77,
 void ZopfliInitBlockState(const ZopfliOptions* options,
                           size_t blockstart, size_t blockend, int add_lmc,
                           ZopfliBlockState* s) {
+  ZopfliScratch* scratch = options->scratch;
   s->options = options;
+  s->scratch = scratch;
   s->blockstart = blockstart;
   s->blockend = blockend;
+  s->warmfreqs = 0;
+  s->bestfreqs = 0;
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
-  if (add_lmc) {
+  if (add_lmc && scratch && !scratch->lmc_used) {
+    size_t blocksize = blockend - blockstart;
+    if (scratch->lmcsize < blocksize) {
+      if (scratch->lmcsize) ZopfliCleanCache(&scratch->lmc);
+      ZopfliAllocCache(blocksize, &scratch->lmc);
+      scratch->lmcsize = blocksize;
+    }
+    ZopfliResetCache(blocksize, &scratch->lmc);
+    scratch->lmc_used = 1;
+    s->lmc = &scratch->lmc;
+  } else if (add_lmc) {
     s->lmc = (ZopfliLongestMatchCache*)malloc(sizeof(ZopfliLongestMatchCache));
     ZopfliInitCache(blockend - blockstart, s->lmc);
   } else {
@@ -233,13 +277,88 @@ void ZopfliInitBlockState(const ZopfliOptions* options,
 
 void ZopfliCleanBlockState(ZopfliBlockState* s) {
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
-  if (s->lmc) {
+  if (s->scratch && s->lmc == &s->scratch->lmc) {
+    s->scratch->lmc_used = 0;
+  } else if (s->lmc) {
     ZopfliCleanCache(s->lmc);
     free(s->lmc);
   }
 #endif
 }
 
+ZopfliHash* ZopfliAcquireHash(ZopfliBlockState* s, ZopfliHash* h) {
+  if (s->scratch && !s->scratch->hash_used) {
+    s->scratch->hash_used = 1;
+    h = &s->scratch->hash;
+    ZopfliResetHash(ZOPFLI_WINDOW_SIZE, h);
+    return h;
+  }
+  ZopfliInitHash(ZOPFLI_WINDOW_SIZE, h);
+  return h;
+}
+
+void ZopfliReleaseHash(ZopfliBlockState* s, ZopfliHash* h) {
+  if (s->scratch && h == &s->scratch->hash) {
+    s->scratch->hash_used = 0;
+  } else {
+    ZopfliCleanHash(h);
+  }
+}
+
+void ZopfliInitMatchTable(ZopfliMatchTable* matches) {
+  matches->lengths = 0;
+  matches->size = 0;
+  matches->pairs = 0;
+  matches->pairssize = 0;
+  matches->pairscapacity = 0;
+}
+
+void ZopfliCleanMatchTable(ZopfliMatchTable* matches) {
+  free(matches->lengths);
+  free(matches->pairs);
+}
+
+ZopfliScratch* ZopfliCreateScratch(void) {
+  ZopfliScratch* scratch = (ZopfliScratch*)calloc(1, sizeof(ZopfliScratch));
+  if (!scratch) exit(-1); /* Allocation failed. */
+  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, &scratch->hash);
+  ZopfliInitMatchTable(&scratch->matches);
+  return scratch;
+}
+
+void ZopfliDestroyScratch(ZopfliScratch* scratch) {
+  if (!scratch) return;
+  ZopfliCleanHash(&scratch->hash);
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  if (scratch->lmcsize) ZopfliCleanCache(&scratch->lmc);
+#endif
+  free(scratch->costs);
+  free(scratch->length_array);
+  free(scratch->dist_array);
+  free(scratch->path);
+  ZopfliCleanMatchTable(&scratch->matches);
+  free(scratch);
+}
+
+void ZopfliReserveScratch(ZopfliScratch* scratch, size_t size) {
+  if (size <= scratch->size && scratch->costs) return;
+  free(scratch->costs);
+  free(scratch->length_array);
+  free(scratch->dist_array);
+  free(scratch->path);
+  scratch->costs = (float*)malloc(sizeof(float) * (size + 1));
+  scratch->length_array =
+      (unsigned short*)malloc(sizeof(unsigned short) * (size + 1));
+  scratch->dist_array =
+      (unsigned short*)malloc(sizeof(unsigned short) * (size + 1));
+  scratch->path = (unsigned short*)malloc(sizeof(unsigned short) * (size + 1));
+  if (!scratch->costs || !scratch->length_array || !scratch->dist_array
+      || !scratch->path) {
+    exit(-1); /* Allocation failed. */
+  }
+  scratch->size = size;
+}
+
 /*
 Gets a score of the length given the distance. Typically, the score of the
 length is the length itself, but if the distance is very long, decrease the
@@ -293,7 +412,12 @@ match is the earlier position to compare.
 end is the last possible byte, beyond which to stop looking.
 safe_end is a few (8) bytes before end, for comparing multiple bytes at once.
 */
-static const unsigned char* GetMatch(const unsigned char* scan,
+typedef const unsigned char* GetMatchFun(const unsigned char* scan,
+                                         const unsigned char* match,
+                                         const unsigned char* end,
+                                         const unsigned char* safe_end);
+
+static const unsigned char* GetMatchScalar(const unsigned char* scan,
                                      const unsigned char* match,
                                      const unsigned char* end,
                                      const unsigned char* safe_end) {
@@ -329,6 +453,71 @@ static const unsigned char* GetMatch(const unsigned char* scan,
   return scan;
 }
 
+#ifdef ZOPFLI_SIMD_MATCH
+/*
+Same as GetMatchScalar, but compares 16 bytes per step. The first differing
+byte is the lowest bit set in the inverted comparison mask.
+*/
+__attribute__((target("sse2")))
+static const unsigned char* GetMatchSSE2(const unsigned char* scan,
+                                         const unsigned char* match,
+                                         const unsigned char* end,
+                                         const unsigned char* safe_end) {
+  while (end - scan >= 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)scan);
+    __m128i b = _mm_loadu_si128((const __m128i*)match);
+    unsigned mask = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+    if (mask) return scan + __builtin_ctz(mask);
+    scan += 16;
+    match += 16;
+  }
+  return GetMatchScalar(scan, match, end, safe_end);
+}
+
+/* Same as GetMatchSSE2, but compares 32 bytes per step. */
+__attribute__((target("avx2")))
+static const unsigned char* GetMatchAVX2(const unsigned char* scan,
+                                         const unsigned char* match,
+                                         const unsigned char* end,
+                                         const unsigned char* safe_end) {
+  while (end - scan >= 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)scan);
+    __m256i b = _mm256_loadu_si256((const __m256i*)match);
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    if (mask) return scan + __builtin_ctz(mask);
+    scan += 32;
+    match += 32;
+  }
+  if (end - scan >= 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)scan);
+    __m128i b = _mm_loadu_si128((const __m128i*)match);
+    unsigned mask = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+    if (mask) return scan + __builtin_ctz(mask);
+    scan += 16;
+    match += 16;
+  }
+  return GetMatchScalar(scan, match, end, safe_end);
+}
+#endif
+
+/*
+Returns the fastest GetMatch the CPU supports. All of them give the same
+results.
+*/
+static GetMatchFun* GetMatchImpl(void) {
+  static GetMatchFun* impl = 0;
+  if (!impl) {
+#ifdef ZOPFLI_SIMD_MATCH
+    if (__builtin_cpu_supports("avx2")) impl = GetMatchAVX2;
+    else if (__builtin_cpu_supports("sse2")) impl = GetMatchSSE2;
+    else impl = GetMatchScalar;
+#else
+    impl = GetMatchScalar;
+#endif
+  }
+  return impl;
+}
+
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
 /*
 Gets distance, length and sublen values from the cache if possible.
@@ -419,6 +608,7 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
 #endif
 
   unsigned dist = 0;  /* Not unsigned short on purpose. */
+  GetMatchFun* GetMatch = GetMatchImpl();
 
   int* hhead = h->head;
   unsigned short* hprev = h->prev;
@@ -563,8 +753,11 @@ void ZopfliLZ77Greedy(ZopfliBlockState* s, const unsigned char* in,
 #endif
 
   if (instart == inend) return;
+  /* Typical data needs about one symbol per three bytes, the store doubles if
+  it needs more. Reserving one per byte would take 19 bytes per input byte. */
+  ZopfliReserveLZ77Store(store, store->size + (inend - instart) / 3);
 
-  ZopfliInitHash(ZOPFLI_WINDOW_SIZE, h);
+  h = ZopfliAcquireHash(s, &hash);
   ZopfliWarmupHash(in, windowstart, inend, h);
   for (i = windowstart; i < instart; i++) {
     ZopfliUpdateHash(in, i, inend, h);
@@ -630,5 +823,5 @@ void ZopfliLZ77Greedy(ZopfliBlockState* s, const unsigned char* in,
     }
   }
 
-  ZopfliCleanHash(h);
+  ZopfliReleaseHash(s, h);
 }
@@ -39,31 +39,39 @@ no dist and the corresponding litlens value is a literal instead of a length.
 Parameter size: The size of both the litlens and dists arrays.
 The memory can best be managed by using ZopfliInitLZ77Store to initialize it,
 ZopfliCleanLZ77Store to destroy it, and ZopfliStoreLitLenDist to append values.
-
+All arrays share one allocation, ZopfliReserveLZ77Store sizes it up front when
+the amount of symbols is known, otherwise it doubles whenever it is full.
 */
 typedef struct ZopfliLZ77Store {
   unsigned short* litlens;  /* Lit or len. */
   unsigned short* dists;  /* If 0: indicates literal in corresponding litlens,
       if > 0: length in corresponding litlens, this is the distance. */
   size_t size;
+  size_t capacity;  /* Amount of symbols the arrays have room for. */
 
   const unsigned char* data;  /* original data */
-  size_t* pos;  /* position in data where this LZ77 command begins */
+  unsigned* pos;  /* position in data where this LZ77 command begins */
 
   unsigned short* ll_symbol;
-  unsigned short* d_symbol;
+  unsigned char* d_symbol;
 
   /* Cumulative histograms wrapping around per chunk. Each chunk has the amount
   of distinct symbols as length, so using 1 value per LZ77 symbol, we have a
   precise histogram at every N symbols, and the rest can be calculated by
   looping through the actual symbols of this chunk. */
-  size_t* ll_counts;
-  size_t* d_counts;
+  unsigned* ll_counts;
+  unsigned* d_counts;
+
+  void* mem;  /* The allocation holding all of the above. */
 } ZopfliLZ77Store;
 
 void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store);
 void ZopfliCleanLZ77Store(ZopfliLZ77Store* store);
+/* Makes room for capacity symbols, keeping the ones stored already. */
+void ZopfliReserveLZ77Store(ZopfliLZ77Store* store, size_t capacity);
 void ZopfliCopyLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest);
+/* Exchanges the contents of two stores without copying any symbols. */
+void ZopfliSwapLZ77Store(ZopfliLZ77Store* a, ZopfliLZ77Store* b);
 void ZopfliStoreLitLenDist(unsigned short length, unsigned short dist,
                            size_t pos, ZopfliLZ77Store* store);
 void ZopfliAppendLZ77Store(const ZopfliLZ77Store* store,
@@ -78,6 +86,52 @@ void ZopfliLZ77GetHistogram(const ZopfliLZ77Store* lz77,
                             size_t lstart, size_t lend,
                             size_t* ll_counts, size_t* d_counts);
 
+/*
+The matches found at the positions of a block by the squeeze. They don't depend
+on the cost model, so every iteration can reuse them instead of searching again.
+lengths holds the longest match length per position. The distances for the
+lengths 3 up to it are stored position after position in pairs, run length
+encoded as (last length with this distance, distance).
+*/
+typedef struct ZopfliMatchTable {
+  unsigned short* lengths;
+  size_t size;  /* Amount of positions lengths has room for. */
+  unsigned short* pairs;
+  size_t pairssize;
+  size_t pairscapacity;
+} ZopfliMatchTable;
+
+void ZopfliInitMatchTable(ZopfliMatchTable* matches);
+void ZopfliCleanMatchTable(ZopfliMatchTable* matches);
+
+/*
+Scratch memory reused for every block, see ZopfliOptions.scratch. The hash and
+the longest match cache are handed out to one user at a time, whoever finds
+them in use falls back to allocating its own.
+*/
+struct ZopfliScratch {
+  ZopfliHash hash;
+  int hash_used;
+
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  ZopfliLongestMatchCache lmc;
+  size_t lmcsize;  /* Amount of positions lmc has room for. */
+  int lmc_used;
+#endif
+
+  /* Arrays of the shortest path search, with room for size + 1 values each. */
+  float* costs;
+  unsigned short* length_array;
+  unsigned short* dist_array;
+  unsigned short* path;
+  size_t size;
+
+  ZopfliMatchTable matches;
+};
+
+/* Grows the shortest path arrays of the scratch to hold size + 1 values. */
+void ZopfliReserveScratch(ZopfliScratch* scratch, size_t size);
+
 /*
 Some state information for compressing a block.
 This is currently a bit under-used (with mainly only the longest match cache),
@@ -91,9 +145,20 @@ typedef struct ZopfliBlockState {
   ZopfliLongestMatchCache* lmc;
 #endif
 
+  /* Memory to reuse instead of allocating, or NULL. */
+  ZopfliScratch* scratch;
+
   /* The start (inclusive) and end (not inclusive) of the current block. */
   size_t blockstart;
   size_t blockend;
+
+  /*
+  ZOPFLI_WARM_FREQS symbol frequencies the optimal LZ77 starts from instead of
+  a greedy run, or NULL. See ZopfliWarmStart.
+  */
+  const unsigned* warmfreqs;
+  /* Receives the symbol frequencies of the best LZ77 found, or NULL. */
+  unsigned* bestfreqs;
 } ZopfliBlockState;
 
 void ZopfliInitBlockState(const ZopfliOptions* options,
@@ -101,6 +166,15 @@ void ZopfliInitBlockState(const ZopfliOptions* options,
                           ZopfliBlockState* s);
 void ZopfliCleanBlockState(ZopfliBlockState* s);
 
+/*
+Returns a hash initialized for a new run. This is the one of the scratch if
+there is one and it is free, otherwise h gets allocated.
+*/
+ZopfliHash* ZopfliAcquireHash(ZopfliBlockState* s, ZopfliHash* h);
+
+/* Gives back a hash returned by ZopfliAcquireHash. */
+void ZopfliReleaseHash(ZopfliBlockState* s, ZopfliHash* h);
+
 /*
 Finds the longest match (length and corresponding distance) for LZ77
 compression.
@@ -28,6 +28,12 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "tree.h"
 #include "util.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* The forward pass relaxes several lengths at once with SSE2. */
+#define ZOPFLI_SIMD_COSTS
+#include <emmintrin.h>
+#endif
+
 typedef struct SymbolStats {
   /* The literal and length symbols. */
   size_t litlens[ZOPFLI_NUM_LL];
@@ -112,111 +118,152 @@ static void ClearStatFreqs(SymbolStats* stats) {
 }
 
 /*
-Function that calculates a cost based on a model for the given LZ77 symbol.
-litlen: means literal symbol if dist is 0, length otherwise.
-*/
-typedef double CostModelFun(unsigned litlen, unsigned dist, void* context);
-
-/*
-Cost model which should exactly match fixed tree.
-type: CostModelFun
+The cost model of a squeeze run, in bits. It is tabulated once per run so the
+forward pass only does lookups: the cost of a length and distance pair is
+lengths[length] + dists[distance symbol], extra bits included.
 */
-static double GetCostFixed(unsigned litlen, unsigned dist, void* unused) {
-  (void)unused;
-  if (dist == 0) {
-    if (litlen <= 143) return 8;
-    else return 9;
-  } else {
-    int dbits = ZopfliGetDistExtraBits(dist);
-    int lbits = ZopfliGetLengthExtraBits(litlen);
-    int lsym = ZopfliGetLengthSymbol(litlen);
-    double cost = 0;
-    if (lsym <= 279) cost += 7;
-    else cost += 8;
-    cost += 5;  /* Every dist symbol has length 5. */
-    return cost + dbits + lbits;
+typedef struct CostModel {
+  float literals[256];
+  float lengths[ZOPFLI_MAX_MATCH + 1];
+  float dists[ZOPFLI_NUM_D];
+} CostModel;
+
+/* Cost model which should exactly match fixed tree. */
+static void GetCostFixed(CostModel* model) {
+  int i;
+  for (i = 0; i < 256; i++) model->literals[i] = i <= 143 ? 8 : 9;
+  for (i = 0; i < ZOPFLI_MIN_MATCH; i++) model->lengths[i] = 0;
+  for (i = ZOPFLI_MIN_MATCH; i <= ZOPFLI_MAX_MATCH; i++) {
+    int lsym = ZopfliGetLengthSymbol(i);
+    model->lengths[i] = (lsym <= 279 ? 7 : 8) + ZopfliGetLengthExtraBits(i);
+  }
+  for (i = 0; i < ZOPFLI_NUM_D; i++) {
+    /* Every dist symbol has length 5. */
+    model->dists[i] = i < 30 ? 5 + ZopfliGetDistSymbolExtraBits(i)
+                             : ZOPFLI_LARGE_FLOAT;
   }
 }
 
-/*
-Cost model based on symbol statistics.
-type: CostModelFun
-*/
-static double GetCostStat(unsigned litlen, unsigned dist, void* context) {
-  SymbolStats* stats = (SymbolStats*)context;
-  if (dist == 0) {
-    return stats->ll_symbols[litlen];
-  } else {
-    int lsym = ZopfliGetLengthSymbol(litlen);
-    int lbits = ZopfliGetLengthExtraBits(litlen);
-    int dsym = ZopfliGetDistSymbol(dist);
-    int dbits = ZopfliGetDistExtraBits(dist);
-    return stats->ll_symbols[lsym] + lbits + stats->d_symbols[dsym] + dbits;
+/* Cost model based on symbol statistics. */
+static void GetCostStat(const SymbolStats* stats, CostModel* model) {
+  int i;
+  for (i = 0; i < 256; i++) model->literals[i] = stats->ll_symbols[i];
+  for (i = 0; i < ZOPFLI_MIN_MATCH; i++) model->lengths[i] = 0;
+  for (i = ZOPFLI_MIN_MATCH; i <= ZOPFLI_MAX_MATCH; i++) {
+    int lsym = ZopfliGetLengthSymbol(i);
+    model->lengths[i] =
+        stats->ll_symbols[lsym] + ZopfliGetLengthExtraBits(i);
+  }
+  for (i = 0; i < ZOPFLI_NUM_D; i++) {
+    model->dists[i] = i < 30
+        ? stats->d_symbols[i] + ZopfliGetDistSymbolExtraBits(i)
+        : ZOPFLI_LARGE_FLOAT;
   }
 }
 
 /*
-Finds the minimum possible cost this cost model can return for valid length and
-distance symbols.
+Relaxes the costs to reach the lengths [kstart, kend] from one position, all
+using the same distance.
+costs: the costs array from the current position on
+length_array: the length_array from the current position on
+dist_array: the dist_array from the current position on
+base: cost to get to the current position plus the cost of the distance
+lengths: cost of each length
+dist: the distance
 */
-static double GetCostModelMinCost(CostModelFun* costmodel, void* costcontext) {
-  double mincost;
-  int bestlength = 0; /* length that has lowest cost in the cost model */
-  int bestdist = 0; /* distance that has lowest cost in the cost model */
-  int i;
-  /*
-  Table of distances that have a different distance symbol in the deflate
-  specification. Each value is the first distance that has a new symbol. Only
-  different symbols affect the cost model so only these need to be checked.
-  See RFC 1951 section 3.2.5. Compressed blocks (length and distance codes).
-  */
-  static const int dsymbols[30] = {
-    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
-    769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-  };
-
-  mincost = ZOPFLI_LARGE_FLOAT;
-  for (i = 3; i < 259; i++) {
-    double c = costmodel(i, 1, costcontext);
-    if (c < mincost) {
-      bestlength = i;
-      mincost = c;
+typedef void RelaxLengthsFun(float* costs, unsigned short* length_array,
+                             unsigned short* dist_array,
+                             float base, const float* lengths,
+                             unsigned short dist, size_t kstart, size_t kend);
+
+static void RelaxLengthsScalar(float* costs, unsigned short* length_array,
+                               unsigned short* dist_array,
+                               float base, const float* lengths,
+                               unsigned short dist, size_t kstart,
+                               size_t kend) {
+  size_t k;
+  for (k = kstart; k <= kend; k++) {
+    float newCost = base + lengths[k];
+    if (newCost < costs[k]) {
+      costs[k] = newCost;
+      length_array[k] = k;
+      dist_array[k] = dist;
     }
   }
+}
 
-  mincost = ZOPFLI_LARGE_FLOAT;
-  for (i = 0; i < 30; i++) {
-    double c = costmodel(3, dsymbols[i], costcontext);
-    if (c < mincost) {
-      bestdist = dsymbols[i];
-      mincost = c;
+#ifdef ZOPFLI_SIMD_COSTS
+/* Same as RelaxLengthsScalar, but relaxes 4 lengths per step. */
+__attribute__((target("sse2")))
+static void RelaxLengthsSSE2(float* costs, unsigned short* length_array,
+                             unsigned short* dist_array,
+                             float base, const float* lengths,
+                             unsigned short dist, size_t kstart, size_t kend) {
+  size_t k = kstart;
+  __m128 base4 = _mm_set1_ps(base);
+  for (; k + 3 <= kend; k += 4) {
+    __m128 newcost = _mm_add_ps(base4, _mm_loadu_ps(&lengths[k]));
+    __m128 oldcost = _mm_loadu_ps(&costs[k]);
+    __m128 less = _mm_cmplt_ps(newcost, oldcost);
+    int mask = _mm_movemask_ps(less);
+    if (mask) {
+      _mm_storeu_ps(&costs[k], _mm_or_ps(_mm_and_ps(less, newcost),
+                                         _mm_andnot_ps(less, oldcost)));
+      if (mask & 1) length_array[k] = k, dist_array[k] = dist;
+      if (mask & 2) length_array[k + 1] = k + 1, dist_array[k + 1] = dist;
+      if (mask & 4) length_array[k + 2] = k + 2, dist_array[k + 2] = dist;
+      if (mask & 8) length_array[k + 3] = k + 3, dist_array[k + 3] = dist;
     }
   }
+  RelaxLengthsScalar(costs, length_array, dist_array, base, lengths, dist,
+                     k, kend);
+}
+#endif
+
+/* Returns the fastest RelaxLengths the CPU supports. */
+static RelaxLengthsFun* RelaxLengthsImpl(void) {
+  static RelaxLengthsFun* impl = 0;
+  if (!impl) {
+#ifdef ZOPFLI_SIMD_COSTS
+    if (__builtin_cpu_supports("sse2")) impl = RelaxLengthsSSE2;
+    else impl = RelaxLengthsScalar;
+#else
+    impl = RelaxLengthsScalar;
+#endif
+  }
+  return impl;
+}
 
-  return costmodel(bestlength, bestdist, costcontext);
+/* Marks a position of ZopfliMatchTable where a long repetition is skipped. */
+#define MATCH_SHORTCUT 0x8000
+
+static void AddMatchPair(unsigned short length, unsigned short dist,
+                         ZopfliMatchTable* matches) {
+  if (matches->pairssize + 2 > matches->pairscapacity) {
+    matches->pairscapacity =
+        matches->pairscapacity ? matches->pairscapacity * 2 : 1024;
+    matches->pairs = (unsigned short*)realloc(matches->pairs,
+        sizeof(*matches->pairs) * matches->pairscapacity);
+    if (!matches->pairs) exit(-1); /* Allocation failed. */
+  }
+  matches->pairs[matches->pairssize++] = length;
+  matches->pairs[matches->pairssize++] = dist;
 }
 
 /*
-Performs the forward pass for "squeeze". Gets the most optimal length to reach
-every byte from a previous byte, using cost calculations.
+Finds the longest match and the sublen distances at every position the forward
+pass visits. The matches don't depend on the cost model, so this only has to be
+done once per block and every iteration reuses them.
 s: the ZopfliBlockState
 in: the input data array
 instart: where to start
 inend: where to stop (not inclusive)
-costmodel: function to calculate the cost of some lit/len/dist pair.
-costcontext: abstract context for the costmodel function
-length_array: output array of size (inend - instart) which will receive the best
-    length to reach this byte from a previous byte.
-returns the cost that was, according to the costmodel, needed to get to the end.
+matches: receives the matches of the block
 */
-static double GetBestLengths(ZopfliBlockState *s,
-                             const unsigned char* in,
-                             size_t instart, size_t inend,
-                             CostModelFun* costmodel, void* costcontext,
-                             unsigned short* length_array) {
-  /* Best cost to get here so far. */
+static void FindMatches(ZopfliBlockState *s,
+                        const unsigned char* in, size_t instart, size_t inend,
+                        ZopfliMatchTable* matches) {
   size_t blocksize = inend - instart;
-  float* costs;
   size_t i = 0, k;
   unsigned short leng;
   unsigned short dist;
@@ -224,102 +271,208 @@ static double GetBestLengths(ZopfliBlockState *s,
   size_t windowstart = instart > ZOPFLI_WINDOW_SIZE
       ? instart - ZOPFLI_WINDOW_SIZE : 0;
   ZopfliHash hash;
-  ZopfliHash* h = &hash;
-  double result;
-  double mincost = GetCostModelMinCost(costmodel, costcontext);
+  ZopfliHash* h;
 
-  if (instart == inend) return 0;
+  matches->pairssize = 0;
+  if (instart == inend) return;
 
-  costs = (float*)malloc(sizeof(float) * (blocksize + 1));
-  if (!costs) exit(-1); /* Allocation failed. */
+  if (matches->size < blocksize) {
+    free(matches->lengths);
+    matches->lengths =
+        (unsigned short*)malloc(sizeof(*matches->lengths) * blocksize);
+    if (!matches->lengths) exit(-1); /* Allocation failed. */
+    matches->size = blocksize;
+  }
 
-  ZopfliInitHash(ZOPFLI_WINDOW_SIZE, h);
+  h = ZopfliAcquireHash(s, &hash);
   ZopfliWarmupHash(in, windowstart, inend, h);
   for (i = windowstart; i < instart; i++) {
     ZopfliUpdateHash(in, i, inend, h);
   }
 
-  for (i = 1; i < blocksize + 1; i++) costs[i] = ZOPFLI_LARGE_FLOAT;
-  costs[0] = 0;  /* Because it's the start. */
-  length_array[0] = 0;
-
   for (i = instart; i < inend; i++) {
-    size_t j = i - instart;  /* Index in the costs array and length_array. */
+    size_t j = i - instart;  /* Index in the lengths array. */
     ZopfliUpdateHash(in, i, inend, h);
 
 #ifdef ZOPFLI_SHORTCUT_LONG_REPETITIONS
     /* If we're in a long repetition of the same character and have more than
-    ZOPFLI_MAX_MATCH characters before and after our position. */
+    ZOPFLI_MAX_MATCH characters before and after our position. The forward
+    pass reaches the next ZOPFLI_MAX_MATCH positions with ZOPFLI_MAX_MATCH
+    long matches and skips them, so no need to look for matches there. */
     if (h->same[i & ZOPFLI_WINDOW_MASK] > ZOPFLI_MAX_MATCH * 2
         && i > instart + ZOPFLI_MAX_MATCH + 1
         && i + ZOPFLI_MAX_MATCH * 2 + 1 < inend
         && h->same[(i - ZOPFLI_MAX_MATCH) & ZOPFLI_WINDOW_MASK]
             > ZOPFLI_MAX_MATCH) {
-      double symbolcost = costmodel(ZOPFLI_MAX_MATCH, 1, costcontext);
+      matches->lengths[j] = MATCH_SHORTCUT;
+      for (k = 0; k < ZOPFLI_MAX_MATCH; k++) {
+        i++;
+        j++;
+        ZopfliUpdateHash(in, i, inend, h);
+      }
+    }
+#endif
+
+    ZopfliFindLongestMatch(s, h, in, i, inend, ZOPFLI_MAX_MATCH, sublen,
+                           &dist, &leng);
+    if (leng > inend - i) leng = inend - i;
+    matches->lengths[j] = leng;
+
+    /* Lengths sharing a distance are stored as one pair. */
+    for (k = 3; k <= leng; k++) {
+      if (k == leng || sublen[k + 1] != sublen[k]) {
+        AddMatchPair(k, sublen[k], matches);
+      }
+    }
+  }
+
+  ZopfliReleaseHash(s, h);
+}
+
+/*
+Performs the forward pass for "squeeze". Gets the most optimal length to reach
+every byte from a previous byte, using cost calculations.
+in: the input data array
+instart: where to start
+inend: where to stop (not inclusive)
+matches: the matches of the block, see FindMatches
+model: the cost model
+length_array: output array of size (inend - instart) which will receive the best
+    length to reach this byte from a previous byte.
+dist_array: output array of size (inend - instart) which will receive the
+    distance of that length, 0 for a literal.
+costs: array of size (inend - instart + 1) used to store the costs.
+returns the cost that was, according to the costmodel, needed to get to the end.
+*/
+static double GetBestLengths(const unsigned char* in,
+                             size_t instart, size_t inend,
+                             const ZopfliMatchTable* matches,
+                             const CostModel* model,
+                             unsigned short* length_array,
+                             unsigned short* dist_array, float* costs) {
+  /* Best cost to get here so far. */
+  size_t blocksize = inend - instart;
+  size_t i = 0, k;
+  unsigned short leng;
+  const unsigned short* pair = matches->pairs;
+  RelaxLengthsFun* RelaxLengths = RelaxLengthsImpl();
+  double result;
+
+  if (instart == inend) return 0;
+
+  for (i = 1; i < blocksize + 1; i++) costs[i] = ZOPFLI_LARGE_FLOAT;
+  costs[0] = 0;  /* Because it's the start. */
+  length_array[0] = 0;
+
+  for (i = instart; i < inend; i++) {
+    size_t j = i - instart;  /* Index in the costs array and length_array. */
+
+#ifdef ZOPFLI_SHORTCUT_LONG_REPETITIONS
+    if (matches->lengths[j] == MATCH_SHORTCUT) {
+      float symbolcost = model->lengths[ZOPFLI_MAX_MATCH] + model->dists[0];
       /* Set the length to reach each one to ZOPFLI_MAX_MATCH, and the cost to
       the cost corresponding to that length. Doing this, we skip
       ZOPFLI_MAX_MATCH values to avoid calling ZopfliFindLongestMatch. */
       for (k = 0; k < ZOPFLI_MAX_MATCH; k++) {
         costs[j + ZOPFLI_MAX_MATCH] = costs[j] + symbolcost;
         length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH;
+        dist_array[j + ZOPFLI_MAX_MATCH] = 1;
         i++;
         j++;
-        ZopfliUpdateHash(in, i, inend, h);
       }
     }
 #endif
 
-    ZopfliFindLongestMatch(s, h, in, i, inend, ZOPFLI_MAX_MATCH, sublen,
-                           &dist, &leng);
+    leng = matches->lengths[j];
 
     /* Literal. */
     if (i + 1 <= inend) {
-      double newCost = costs[j] + costmodel(in[i], 0, costcontext);
+      float newCost = costs[j] + model->literals[in[i]];
       assert(newCost >= 0);
       if (newCost < costs[j + 1]) {
         costs[j + 1] = newCost;
         length_array[j + 1] = 1;
+        dist_array[j + 1] = 0;
       }
     }
-    /* Lengths. */
-    for (k = 3; k <= leng && i + k <= inend; k++) {
-      double newCost;
-
-      /* Calling the cost model is expensive, avoid this if we are already at
-      the minimum possible cost that it can return. */
-     if (costs[j + k] - costs[j] <= mincost) continue;
-
-      newCost = costs[j] + costmodel(k, sublen[k], costcontext);
-      assert(newCost >= 0);
-      if (newCost < costs[j + k]) {
-        assert(k <= ZOPFLI_MAX_MATCH);
-        costs[j + k] = newCost;
-        length_array[j + k] = k;
-      }
+    /* Lengths, one run of lengths sharing a distance at a time. */
+    for (k = 3; k <= leng; pair += 2) {
+      float base = costs[j] + model->dists[ZopfliGetDistSymbol(pair[1])];
+      assert(pair[0] <= ZOPFLI_MAX_MATCH);
+      RelaxLengths(&costs[j], &length_array[j], &dist_array[j], base,
+                   model->lengths, pair[1], k, pair[0]);
+      k = pair[0] + 1;
     }
   }
 
   assert(costs[blocksize] >= 0);
   result = costs[blocksize];
 
-  ZopfliCleanHash(h);
-  free(costs);
-
   return result;
 }
 
+/*
+The arrays of the shortest path search. They come from the scratch of the block
+state if it has one, otherwise they are allocated for this block.
+*/
+typedef struct SqueezeArrays {
+  unsigned short* length_array;
+  unsigned short* dist_array;
+  unsigned short* path;
+  float* costs;
+  ZopfliMatchTable* matches;
+  ZopfliMatchTable ownmatches;
+  int owned;  /* Whether the arrays were allocated here. */
+} SqueezeArrays;
+
+static void InitSqueezeArrays(ZopfliBlockState* s, size_t blocksize,
+                              SqueezeArrays* a) {
+  if (s->scratch) {
+    ZopfliReserveScratch(s->scratch, blocksize);
+    a->length_array = s->scratch->length_array;
+    a->dist_array = s->scratch->dist_array;
+    a->path = s->scratch->path;
+    a->costs = s->scratch->costs;
+    a->matches = &s->scratch->matches;
+    a->owned = 0;
+    return;
+  }
+  ZopfliInitMatchTable(&a->ownmatches);
+  a->matches = &a->ownmatches;
+  a->length_array =
+      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
+  a->dist_array =
+      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
+  a->path = (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
+  a->costs = (float*)malloc(sizeof(float) * (blocksize + 1));
+  a->owned = 1;
+  if (!a->length_array || !a->dist_array || !a->path || !a->costs) {
+    exit(-1); /* Allocation failed. */
+  }
+}
+
+static void CleanSqueezeArrays(SqueezeArrays* a) {
+  if (!a->owned) return;
+  free(a->length_array);
+  free(a->dist_array);
+  free(a->path);
+  free(a->costs);
+  ZopfliCleanMatchTable(&a->ownmatches);
+}
+
 /*
 Calculates the optimal path of lz77 lengths to use, from the calculated
 length_array. The length_array must contain the optimal length to reach that
 byte. The path will be filled with the lengths to use, so its data size will be
-the amount of lz77 symbols.
+the amount of lz77 symbols. path must have room for size values.
 */
 static void TraceBackwards(size_t size, const unsigned short* length_array,
-                           unsigned short** path, size_t* pathsize) {
+                           unsigned short* path, size_t* pathsize) {
   size_t index = size;
+  *pathsize = 0;
   if (size == 0) return;
   for (;;) {
-    ZOPFLI_APPEND_DATA(length_array[index], path, pathsize);
+    path[(*pathsize)++] = length_array[index];
     assert(length_array[index] <= index);
     assert(length_array[index] <= ZOPFLI_MAX_MATCH);
     assert(length_array[index] != 0);
@@ -329,68 +482,44 @@ static void TraceBackwards(size_t size, const unsigned short* length_array,
 
   /* Mirror result. */
   for (index = 0; index < *pathsize / 2; index++) {
-    unsigned short temp = (*path)[index];
-    (*path)[index] = (*path)[*pathsize - index - 1];
-    (*path)[*pathsize - index - 1] = temp;
+    unsigned short temp = path[index];
+    path[index] = path[*pathsize - index - 1];
+    path[*pathsize - index - 1] = temp;
   }
 }
 
-static void FollowPath(ZopfliBlockState* s,
-                       const unsigned char* in, size_t instart, size_t inend,
-                       unsigned short* path, size_t pathsize,
+/*
+Appends the LZ77 symbols of the path to the store. The distances come from the
+forward pass, see GetBestLengths.
+*/
+static void FollowPath(const unsigned char* in, size_t instart, size_t inend,
+                       const unsigned short* path, size_t pathsize,
+                       const unsigned short* dist_array,
                        ZopfliLZ77Store* store) {
-  size_t i, j, pos = 0;
-  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE
-      ? instart - ZOPFLI_WINDOW_SIZE : 0;
-
-  size_t total_length_test = 0;
-
-  ZopfliHash hash;
-  ZopfliHash* h = &hash;
+  size_t i, pos = instart;
 
   if (instart == inend) return;
+  /* Every step of the path is one symbol. */
+  ZopfliReserveLZ77Store(store, store->size + pathsize);
 
-  ZopfliInitHash(ZOPFLI_WINDOW_SIZE, h);
-  ZopfliWarmupHash(in, windowstart, inend, h);
-  for (i = windowstart; i < instart; i++) {
-    ZopfliUpdateHash(in, i, inend, h);
-  }
-
-  pos = instart;
   for (i = 0; i < pathsize; i++) {
     unsigned short length = path[i];
-    unsigned short dummy_length;
-    unsigned short dist;
     assert(pos < inend);
 
-    ZopfliUpdateHash(in, pos, inend, h);
-
     /* Add to output. */
     if (length >= ZOPFLI_MIN_MATCH) {
-      /* Get the distance by recalculating longest match. The found length
-      should match the length from the path. */
-      ZopfliFindLongestMatch(s, h, in, pos, inend, length, 0,
-                             &dist, &dummy_length);
-      assert(!(dummy_length != length && length > 2 && dummy_length > 2));
+      unsigned short dist = dist_array[pos + length - instart];
       ZopfliVerifyLenDist(in, inend, pos, dist, length);
       ZopfliStoreLitLenDist(length, dist, pos, store);
-      total_length_test += length;
     } else {
       length = 1;
       ZopfliStoreLitLenDist(in[pos], 0, pos, store);
-      total_length_test++;
     }
 
-
     assert(pos + length <= inend);
-    for (j = 1; j < length; j++) {
-      ZopfliUpdateHash(in, pos + j, inend, h);
-    }
-
     pos += length;
   }
-
-  ZopfliCleanHash(h);
+  assert(pos == inend);
 }
 
 /* Calculates the entropy of the statistics */
@@ -419,45 +548,55 @@ static void GetStatistics(const ZopfliLZ77Store* store, SymbolStats* stats) {
 Does a single run for ZopfliLZ77Optimal. For good compression, repeated runs
 with updated statistics should be performed.
 
-s: the block state
 in: the input data array
 instart: where to start
 inend: where to stop (not inclusive)
-path: pointer to dynamically allocated memory to store the path
-pathsize: pointer to the size of the dynamic path array
+matches: the matches of the block, see FindMatches
+path: array of size (inend - instart) used to store the path
 length_array: array of size (inend - instart) used to store lengths
-costmodel: function to use as the cost model for this squeeze run
-costcontext: abstract context for the costmodel function
+dist_array: array of size (inend - instart) used to store distances
+costs: array of size (inend - instart + 1) used to store costs
+model: the cost model for this squeeze run
 store: place to output the LZ77 data
 returns the cost that was, according to the costmodel, needed to get to the end.
     This is not the actual cost.
 */
-static double LZ77OptimalRun(ZopfliBlockState* s,
-    const unsigned char* in, size_t instart, size_t inend,
-    unsigned short** path, size_t* pathsize,
-    unsigned short* length_array, CostModelFun* costmodel,
-    void* costcontext, ZopfliLZ77Store* store) {
-  double cost = GetBestLengths(
-      s, in, instart, inend, costmodel, costcontext, length_array);
-  free(*path);
-  *path = 0;
-  *pathsize = 0;
-  TraceBackwards(inend - instart, length_array, path, pathsize);
-  FollowPath(s, in, instart, inend, *path, *pathsize, store);
+static double LZ77OptimalRun(const unsigned char* in,
+    size_t instart, size_t inend,
+    const ZopfliMatchTable* matches,
+    unsigned short* path, unsigned short* length_array,
+    unsigned short* dist_array, float* costs,
+    const CostModel* model, ZopfliLZ77Store* store) {
+  size_t pathsize;
+  double cost = GetBestLengths(in, instart, inend, matches, model,
+                               length_array, dist_array, costs);
+  TraceBackwards(inend - instart, length_array, path, &pathsize);
+  FollowPath(in, instart, inend, path, pathsize, dist_array, store);
   assert(cost < ZOPFLI_LARGE_FLOAT);
   return cost;
 }
 
-void ZopfliLZ77Optimal(ZopfliBlockState *s,
-                       const unsigned char* in, size_t instart, size_t inend,
-                       int numiterations,
-                       ZopfliLZ77Store* store) {
-  /* Dist to get to here with smallest cost. */
-  size_t blocksize = inend - instart;
-  unsigned short* length_array =
-      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
-  unsigned short* path = 0;
-  size_t pathsize = 0;
+/*
+Runs one chain of iterations of ZopfliLZ77Optimal, each time using the
+statistics of the previous run.
+s: the block state
+matches: the matches of the block, see FindMatches
+numiterations: iterations to run, ZopfliOptions.stalliterations and stop may
+    end the chain sooner or later
+stats: statistics to start from
+seed: seed of the randomization. Chains other than seed 0 start from randomized
+    statistics, so they explore different paths.
+store: receives the best LZ77 data of the chain
+returns the size of the best block the chain found.
+*/
+static double RunIterations(ZopfliBlockState *s,
+                            const unsigned char* in,
+                            size_t instart, size_t inend, int numiterations,
+                            const ZopfliMatchTable* matches,
+                            const SymbolStats* initialstats, unsigned seed,
+                            ZopfliLZ77Store* store) {
+  SqueezeArrays arrays;
+  CostModel model;
   ZopfliLZ77Store currentstore;
   SymbolStats stats, beststats, laststats;
   int i;
@@ -467,41 +606,51 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   /* Try randomizing the costs a bit once the size stabilizes. */
   RanState ran_state;
   int lastrandomstep = -1;
+  int lastimprovement = 0;
+  int stall = s->options->stalliterations;
+  int maxiterations = numiterations;
 
-  if (!length_array) exit(-1); /* Allocation failed. */
+  if (stall > 0 && s->options->maxiterations > numiterations) {
+    maxiterations = s->options->maxiterations;
+  }
 
+  InitSqueezeArrays(s, inend - instart, &arrays);
   InitRanState(&ran_state);
-  InitStats(&stats);
+  ran_state.m_w += seed;
   ZopfliInitLZ77Store(in, &currentstore);
 
-  /* Do regular deflate, then loop multiple shortest path runs, each time using
-  the statistics of the previous run. */
-
-  /* Initial run. */
-  ZopfliLZ77Greedy(s, in, instart, inend, &currentstore);
-  GetStatistics(&currentstore, &stats);
+  CopyStats((SymbolStats*)initialstats, &stats);
+  if (seed != 0) {
+    RandomizeStatFreqs(&ran_state, &stats);
+    CalculateStatistics(&stats);
+  }
 
   /* Repeat statistics with each time the cost model from the previous stat
   run. */
-  for (i = 0; i < numiterations; i++) {
-    ZopfliCleanLZ77Store(&currentstore);
-    ZopfliInitLZ77Store(in, &currentstore);
-    LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
-                   length_array, GetCostStat, (void*)&stats,
-                   &currentstore);
+  for (i = 0; i < maxiterations; i++) {
+    ZopfliLZ77Store* last = &currentstore;
+    /* Keep the allocation of the previous iteration. */
+    currentstore.size = 0;
+    GetCostStat(&stats, &model);
+    LZ77OptimalRun(in, instart, inend, matches, arrays.path,
+                   arrays.length_array, arrays.dist_array, arrays.costs,
+                   &model, &currentstore);
     cost = ZopfliCalculateBlockSize(&currentstore, 0, currentstore.size, 2);
     if (s->options->verbose_more || (s->options->verbose && cost < bestcost)) {
       fprintf(stderr, "Iteration %d: %d bit\n", i, (int) cost);
     }
     if (cost < bestcost) {
-      /* Copy to the output store. */
-      ZopfliCopyLZ77Store(&currentstore, store);
+      /* Move to the output store, the previous best becomes the buffer of the
+      next iteration. */
+      ZopfliSwapLZ77Store(&currentstore, store);
+      last = store;
       CopyStats(&stats, &beststats);
       bestcost = cost;
+      lastimprovement = i;
     }
     CopyStats(&stats, &laststats);
     ClearStatFreqs(&stats);
-    GetStatistics(&currentstore, &stats);
+    GetStatistics(last, &stats);
     if (lastrandomstep != -1) {
       /* This makes it converge slower but better. Do it only once the
       randomness kicks in so that if the user does few iterations, it gives a
@@ -516,11 +665,121 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
       lastrandomstep = i;
     }
     lastcost = cost;
+
+    if (stall > 0 && i - lastimprovement >= stall) break;
+    if (s->options->stop && s->options->stop(s->options->stopcontext)) break;
   }
 
-  free(length_array);
-  free(path);
+  CleanSqueezeArrays(&arrays);
   ZopfliCleanLZ77Store(&currentstore);
+  return bestcost;
+}
+
+/* The iteration chains of one block, see ZopfliOptions.numseeds. */
+typedef struct IterationChains {
+  ZopfliBlockState* s;
+  const unsigned char* in;
+  size_t instart;
+  size_t inend;
+  int numiterations;
+  const ZopfliMatchTable* matches;
+  const SymbolStats* stats;
+  ZopfliLZ77Store* stores;  /* Best LZ77 data of each chain. */
+  double* costs;  /* Best block size of each chain. */
+} IterationChains;
+
+/* Runs chain i on its own thread. type: ZopfliTask */
+static void RunChain(void* context, size_t i, ZopfliScratch* scratch) {
+  IterationChains* chains = (IterationChains*)context;
+  /* The chains only read the matches, they don't search themselves. */
+  ZopfliBlockState s = *chains->s;
+  s.scratch = scratch;
+  chains->costs[i] = RunIterations(&s, chains->in, chains->instart,
+      chains->inend, chains->numiterations, chains->matches, chains->stats,
+      (unsigned)i, &chains->stores[i]);
+}
+
+void ZopfliLZ77Optimal(ZopfliBlockState *s,
+                       const unsigned char* in, size_t instart, size_t inend,
+                       int numiterations,
+                       ZopfliLZ77Store* store) {
+  SqueezeArrays arrays;
+  ZopfliLZ77Store currentstore;
+  SymbolStats stats;
+  int numseeds = s->options->numseeds > 1 ? s->options->numseeds : 1;
+  IterationChains chains;
+  int i, best = 0;
+
+  InitSqueezeArrays(s, inend - instart, &arrays);
+  InitStats(&stats);
+  ZopfliInitLZ77Store(in, &currentstore);
+
+  /* Do regular deflate, then loop multiple shortest path runs, each time using
+  the statistics of the previous run. */
+
+  /* Initial run, or the statistics of an earlier run on similar data. */
+  if (s->warmfreqs) {
+    for (i = 0; i < ZOPFLI_NUM_LL; i++) stats.litlens[i] = s->warmfreqs[i];
+    for (i = 0; i < ZOPFLI_NUM_D; i++) {
+      stats.dists[i] = s->warmfreqs[ZOPFLI_NUM_LL + i];
+    }
+    CalculateStatistics(&stats);
+  } else {
+    ZopfliLZ77Greedy(s, in, instart, inend, &currentstore);
+    GetStatistics(&currentstore, &stats);
+  }
+  ZopfliCleanLZ77Store(&currentstore);
+
+  /* The matches stay the same for every iteration. */
+  FindMatches(s, in, instart, inend, arrays.matches);
+
+  if (numseeds == 1) {
+    RunIterations(s, in, instart, inend, numiterations, arrays.matches,
+                  &stats, 0, store);
+  } else {
+    /* Several chains from different seeds, the smallest block wins. Ties go
+    to the lowest seed so the result doesn't depend on the threads. */
+    chains.s = s;
+    chains.in = in;
+    chains.instart = instart;
+    chains.inend = inend;
+    chains.numiterations = numiterations;
+    chains.matches = arrays.matches;
+    chains.stats = &stats;
+    chains.stores =
+        (ZopfliLZ77Store*)malloc(sizeof(*chains.stores) * numseeds);
+    chains.costs = (double*)malloc(sizeof(*chains.costs) * numseeds);
+    if (!chains.stores || !chains.costs) exit(-1); /* Allocation failed. */
+    for (i = 0; i < numseeds; i++) ZopfliInitLZ77Store(in, &chains.stores[i]);
+
+    if (s->options->parallel) {
+      s->options->parallel(RunChain, &chains, numseeds);
+    } else {
+      for (i = 0; i < numseeds; i++) {
+        chains.costs[i] = RunIterations(s, in, instart, inend, numiterations,
+            arrays.matches, &stats, (unsigned)i, &chains.stores[i]);
+      }
+    }
+
+    for (i = 1; i < numseeds; i++) {
+      if (chains.costs[i] < chains.costs[best]) best = i;
+    }
+    ZopfliSwapLZ77Store(&chains.stores[best], store);
+
+    for (i = 0; i < numseeds; i++) ZopfliCleanLZ77Store(&chains.stores[i]);
+    free(chains.stores);
+    free(chains.costs);
+  }
+
+  if (s->bestfreqs) {
+    ClearStatFreqs(&stats);
+    GetStatistics(store, &stats);
+    for (i = 0; i < ZOPFLI_NUM_LL; i++) s->bestfreqs[i] = stats.litlens[i];
+    for (i = 0; i < ZOPFLI_NUM_D; i++) {
+      s->bestfreqs[ZOPFLI_NUM_LL + i] = stats.dists[i];
+    }
+  }
+  CleanSqueezeArrays(&arrays);
 }
 
 void ZopfliLZ77OptimalFixed(ZopfliBlockState *s,
@@ -528,23 +787,20 @@ void ZopfliLZ77OptimalFixed(ZopfliBlockState *s,
                             size_t instart, size_t inend,
                             ZopfliLZ77Store* store)
 {
-  /* Dist to get to here with smallest cost. */
-  size_t blocksize = inend - instart;
-  unsigned short* length_array =
-      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
-  unsigned short* path = 0;
-  size_t pathsize = 0;
-
-  if (!length_array) exit(-1); /* Allocation failed. */
+  SqueezeArrays arrays;
+  CostModel model;
+  InitSqueezeArrays(s, inend - instart, &arrays);
 
   s->blockstart = instart;
   s->blockend = inend;
 
   /* Shortest path for fixed tree This one should give the shortest possible
   result for fixed tree, no repeated runs are needed since the tree is known. */
-  LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
-                 length_array, GetCostFixed, 0, store);
+  FindMatches(s, in, instart, inend, arrays.matches);
+  GetCostFixed(&model);
+  LZ77OptimalRun(in, instart, inend, arrays.matches, arrays.path,
+                 arrays.length_array, arrays.dist_array, arrays.costs,
+                 &model, store);
 
-  free(length_array);
-  free(path);
+  CleanSqueezeArrays(&arrays);
 }
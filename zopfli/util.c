@@ -236,4 +236,14 @@ void ZopfliInitOptions(ZopfliOptions* options) {
   options->blocksplitting = 1;
   options->blocksplittinglast = 0;
   options->blocksplittingmax = 15;
+  options->numseeds = 1;
+  options->stalliterations = 0;
+  options->maxiterations = 15;
+  options->stop = 0;
+  options->stopcontext = 0;
+  options->warmstart = 0;
+  options->warmresult = 0;
+  options->squeezewindow = 0;
+  options->scratch = 0;
+  options->parallel = 0;
 }
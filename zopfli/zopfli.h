@@ -27,6 +27,45 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 extern "C" {
 #endif
 
+/*
+Scratch memory for the squeeze: the hash, the longest match cache and the
+arrays of the shortest path search. Its buffers only grow and are reset between
+runs.
+*/
+typedef struct ZopfliScratch ZopfliScratch;
+
+/*
+A task which can run on any thread. scratch is memory of the thread running it
+which isn't used by anything else at the time, or NULL.
+*/
+typedef void ZopfliTask(void* context, size_t i, ZopfliScratch* scratch);
+
+/*
+Runs task(context, i, scratch) for every i in [0, n) and returns once all of
+them are done. The tasks are independent so they may run in parallel.
+*/
+typedef void ZopfliParallelFun(ZopfliTask* task, void* context, size_t n);
+
+/*
+Asked between two iterations of the squeeze, returns nonzero to end the chain
+with the best result found so far.
+*/
+typedef int ZopfliStopFun(void* context);
+
+/* Frequencies per block in ZopfliWarmStart: 288 literal/length, 32 distance. */
+#define ZOPFLI_WARM_FREQS (288 + 32)
+
+/*
+What deflating some data learned that helps with similar data, like the next
+version of an edited file: where its blocks start and the symbol frequencies
+of the best parse of each block. The blocks cover the data in order.
+*/
+typedef struct ZopfliWarmStart {
+  size_t nblocks;
+  size_t* blockstarts;  /* Position of the first byte of each block. */
+  unsigned* freqs;  /* ZOPFLI_WARM_FREQS frequencies of each block. */
+} ZopfliWarmStart;
+
 /*
 Options used throughout the program.
 */
@@ -61,11 +100,76 @@ typedef struct ZopfliOptions {
   extreme results that hurt compression on some files). Default value: 15.
   */
   int blocksplittingmax;
+
+  /*
+  Amount of iteration chains to run on every block. Every chain but the first
+  starts from randomized statistics and randomizes with its own seed, the
+  smallest result wins. More chains give smaller output for more CPU time, with
+  a parallel runner they run at the same time. Default: 1.
+  */
+  int numseeds;
+
+  /*
+  Scratch memory to reuse for every block instead of allocating it anew, see
+  ZopfliCreateScratch. A scratch must only be used by one thread at a time, so
+  threads need their own copy of the options. Default: NULL.
+  */
+  ZopfliScratch* scratch;
+
+  /*
+  Runs independent tasks, like the block split segments of the squeeze,
+  possibly in parallel. NULL runs them one after another. Default: NULL.
+  */
+  ZopfliParallelFun* parallel;
+
+  /*
+  Ends a chain of iterations once this many iterations in a row found no
+  smaller block. Converged blocks stop early this way, while blocks that keep
+  shrinking may go on past numiterations up to maxiterations. 0 always runs
+  exactly numiterations. Default: 0.
+  */
+  int stalliterations;
+
+  /* Upper bound on the iterations of a chain, see stalliterations. */
+  int maxiterations;
+
+  /*
+  Checked after every iteration to end the chain early, e.g. when a time
+  budget is used up. Every chain does at least one iteration. Default: NULL.
+  */
+  ZopfliStopFun* stop;
+  void* stopcontext;
+
+  /*
+  An earlier run on similar data to start from: the block splitting refines
+  its blocks and the iterations start from its statistics instead of a greedy
+  run. Default: NULL.
+  */
+  const ZopfliWarmStart* warmstart;
+
+  /* Receives what this run learned for a later warm start. Default: NULL. */
+  ZopfliWarmStart* warmresult;
+
+  /*
+  Block split segments longer than this are squeezed in pieces of about equal
+  size which are at most this long, so the memory of the squeeze doesn't grow
+  with the size of the data. Every piece still finds matches in the window
+  before it, only the optimal parse can't carry a match across a border,
+  which costs a little compression. 0 squeezes every segment as a whole.
+  Default: 0.
+  */
+  size_t squeezewindow;
 } ZopfliOptions;
 
 /* Initializes options with default values. */
 void ZopfliInitOptions(ZopfliOptions* options);
 
+ZopfliScratch* ZopfliCreateScratch(void);
+void ZopfliDestroyScratch(ZopfliScratch* scratch);
+
+void ZopfliInitWarmStart(ZopfliWarmStart* warm);
+void ZopfliCleanWarmStart(ZopfliWarmStart* warm);
+
 /* Output format */
 typedef enum {
   ZOPFLI_FORMAT_GZIP,